@@ -4,7 +4,7 @@
 #include <stdint.h>
 
 typedef struct dev {
-  int (*read)(void *buf, uint32_t size);
+  int (*read)(void *buf, uint32_t size, uint32_t off); // off is the file offset
   int (*write)(const void *buf, uint32_t size);
 } dev_t;
 
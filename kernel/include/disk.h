@@ -2,9 +2,32 @@
 #define __DISK_H__
 
 #include <stdint.h>
+#include "sem.h"
 
 #define SECTSIZE 512
+#define MAX_SECTS 256 // max sectors of one ATA command
 
+// block io request, sectors [sect, sect+nsect) <-> buf
+typedef struct bio {
+  void *buf;
+  uint32_t sect, nsect; // nsect in 1..MAX_SECTS
+  int write;
+  void (*done)(struct bio *bio); // called when finished (maybe in irq), can be NULL
+  void *priv; // for done
+  volatile int finished;
+  int waiting; // number of procs sleeping on wait
+  sem_t wait;
+  struct bio *next;
+} bio_t;
+
+void init_disk();
+void init_disk_irq();
+void disk_handle();
+void bio_init(bio_t *bio, void *buf, uint32_t sect, uint32_t nsect, int write);
+void bio_submit(bio_t *bio);
+void bio_wait(bio_t *bio);
+void read_disk_multi(void *buf, int sect, int cnt);
+void write_disk_multi(const void *buf, int sect, int cnt);
 void read_disk(void *buf, int sect);
 void write_disk(const void *buf, int sect);
 void copy_from_disk(void *buf, int nbytes, int disk_offset);
@@ -12,6 +35,21 @@ void copy_to_disk(const void *buf, int nbytes, int disk_offset);
 
 #define BLK_SIZE (SECTSIZE * 8)
 
+typedef struct buf buf_t;
+
+void init_bcache();
+buf_t *bget(uint32_t no);
+void *bdata(buf_t *b);
+void bdirty(buf_t *b);
+void bput(buf_t *b);
+uint32_t bno(buf_t *b);
+void bhold(buf_t *b);
+void bunhold(buf_t *b);
+int bcache_size();
+int bcache_stat(void *buf, uint32_t count, uint32_t off);
+void bsync();
+void bprefetch(uint32_t no);
+void bflush_tick(uint32_t tick);
 void bread(void *dst, uint32_t size, uint32_t no, uint32_t off);
 void bwrite(const void *src, uint32_t size, uint32_t no, uint32_t off);
 void bzero(uint32_t no);
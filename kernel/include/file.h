@@ -13,6 +13,9 @@ typedef struct file {
   // for normal file
   inode_t *inode;
   uint32_t offset;
+  // read ahead: if a read starts at ra_next, it is sequential, then
+  // keep the next ra_win blocks (doubled each time) prefetched up to ra_end
+  uint32_t ra_next, ra_win, ra_end;
 
   // for dev file
   dev_t *dev_op;
@@ -4,15 +4,22 @@
 #include <stdint.h>
 
 typedef struct inode inode_t;
+typedef struct fpage fpage_t;
 
 #define EASY_FS // TODO: comment me at Lab3-2
 
 void init_fs();
+void init_icache();
+void init_pcache();
 
 inode_t *iopen(const char *path, int type);
 int iread(inode_t *inode, uint32_t off, void *buf, uint32_t len);
+void ireadahead(inode_t *inode, uint32_t blk, uint32_t n);
 int iwrite(inode_t *inode, uint32_t off, const void *buf, uint32_t len);
 void itrunc(inode_t *inode);
+void isync();
+void isync_tick();
+void isync_due();
 inode_t *idup(inode_t *inode);
 void iclose(inode_t *inode);
 uint32_t isize(inode_t *inode);
@@ -22,6 +29,13 @@ int idevid(inode_t *inode);
 void iadddev(const char *name, int id);
 int iremove(const char *path);
 
+fpage_t *pget(inode_t *inode, uint32_t pgno);
+void *pdata(fpage_t *page);
+void pput(fpage_t *page);
+fpage_t *plookup(void *data);
+void pflush(inode_t *inode, fpage_t *page);
+int ipageable(inode_t *inode);
+
 #ifdef EASY_FS
 
 #define MAX_NAME  (31 - 2 * sizeof(uint32_t))
@@ -0,0 +1,20 @@
+#ifndef __PCI_H__
+#define __PCI_H__
+
+#include <stdint.h>
+
+#define PCI_ID      0x00 // vendor id | device id << 16
+#define PCI_COMMAND 0x04
+#define PCI_CLASS   0x08 // revision | prog if << 8 | subclass << 16 | class << 24
+#define PCI_BAR(n)  (0x10 + 4 * (n))
+
+#define PCI_CMD_IO     0x1
+#define PCI_CMD_MASTER 0x4
+
+#define PCI_DEV(bus, dev, func) (((bus) << 16) | ((dev) << 11) | ((func) << 8))
+
+uint32_t pci_read(uint32_t dev, int reg);
+void pci_write(uint32_t dev, int reg, uint32_t val);
+int pci_find_class(int class, int subclass, uint32_t *dev);
+
+#endif
@@ -31,10 +31,11 @@ typedef struct proc {
   enum {UNUSED, UNINIT, RUNNING, READY, ZOMBIE, BLOCKED} status;
   // WEEK2-interrupt
   //kstack_t *kstack;
-  //Context *ctx; // points to restore context for READY proc
+  Context *ctx; // points to restore context for READY proc, spawn loads into it
   // WEEK3-virtual-memory
-  //PD *pgdir; 
+  PD *pgdir; // spawn loads into it
   //size_t brk;
+  vma_t *vmas; // mmap areas
   // WEEK4-process-api
   //struct proc *parent; 
   //int child_num; 
@@ -46,6 +47,7 @@ typedef struct proc {
 
   //file_t *files[MAX_UFILE]; // Lab3-1
   //inode_t *cwd; // Lab3-2
+  int logop; // depth of nested fs log ops it is in, see log_begin
 } proc_t;
 
 void init_proc();
@@ -56,6 +58,7 @@ void proc_run(proc_t *proc); // __attribute__((noreturn));
 void proc_addready(proc_t *proc);
 void proc_yield();
 void proc_copycurr(proc_t *proc);
+void proc_inheritcurr(proc_t *proc);
 void proc_makezombie(proc_t *proc, int exitcode);
 proc_t *proc_findzombie(proc_t *proc);
 void proc_block();
@@ -2,13 +2,32 @@
 #define __VME_H__
 
 #include "klib.h"
+#include "fs.h"
+
+#define PTE_PCACHE 0x200 // software bit, the page is pinned in page cache
+#define PTE_COW    0x400 // software bit, writable page shared by fork
+
+// mmap area: [start, end) maps inode's data from off, or anonymous memory
+typedef struct vma {
+  size_t start, end; // page aligned
+  int prot;          // PROT_*
+  int flags;         // MAP_*
+  inode_t *inode;    // NULL if MAP_ANON
+  uint32_t off;      // page aligned
+  struct vma *next;  // sorted by start
+} vma_t;
 
 void init_gdt();
 void set_tss(uint32_t ss0, uint32_t esp0);
 
+#define KORDER_MAX 10 // kalloc_order gets at most 2^10 pages (4 MiB)
+
 void init_page();
 void *kalloc();
 void kfree(void *ptr);
+void *kalloc_order(int order);
+void kfree_order(void *ptr, int order);
+uint32_t kheap_stat(uint32_t nblock[KORDER_MAX + 1]);
 
 PD *vm_alloc();
 void vm_teardown(PD *pgdir);
@@ -18,6 +37,9 @@ void *vm_walk(PD *pgdir, size_t va, int prot);
 void vm_map(PD *pgdir, size_t va, size_t len, int prot);
 void vm_unmap(PD *pgdir, size_t va, size_t len);
 void vm_copycurr(PD *pgdir);
-void vm_pgfault(size_t va, int errcode) __attribute__((noreturn));
+size_t vm_mmap(vma_t **vmas, size_t addr, size_t len, int prot, int flags, inode_t *inode, uint32_t off);
+int vm_munmap(PD *pgdir, vma_t **vmas, size_t addr, size_t len);
+void vm_msync(PD *pgdir, vma_t *vmas, inode_t *inode);
+void vm_pgfault(size_t va, int errcode);
 
 #endif
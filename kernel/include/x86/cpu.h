@@ -37,6 +37,23 @@ static inline void outl(int port, uint32_t data) {
   asm volatile ("outl %%eax, %%dx" : : "a"(data), "d"((uint16_t)port));
 }
 
+static inline uint32_t bsf(uint32_t x) {
+  // index of the lowest set bit, x should not be 0
+  uint32_t idx;
+  asm ("bsf %1, %0" : "=r"(idx) : "rm"(x));
+  return idx;
+}
+
+static inline void insl(int port, void *addr, int cnt) {
+  asm volatile ("cld; rep insl"
+    : "+D"(addr), "+c"(cnt) : "d"((uint16_t)port) : "memory", "cc");
+}
+
+static inline void outsl(int port, const void *addr, int cnt) {
+  asm volatile ("cld; rep outsl"
+    : "+S"(addr), "+c"(cnt) : "d"((uint16_t)port) : "memory", "cc");
+}
+
 static inline void cli() {
   asm volatile ("cli");
 }
@@ -5,6 +5,7 @@
 #define T_IRQ0         32
 #define IRQ_TIMER      0
 #define IRQ_COM1       4
+#define IRQ_IDE        14
 #define EX_DE          0
 #define EX_UD          6
 #define EX_NM          7
@@ -4,6 +4,7 @@
 #include "serial.h"
 #include "timer.h"
 #include "proc.h"
+#include "disk.h"
 
 static GateDesc32 idt[NR_IRQ];
 
@@ -113,6 +114,9 @@ void irq_handle(Context *ctx) {
   // TODO: WEEK2 handle serial and timer
   // TODO: WEEK3-virtual-memory: page fault
   // TODO: WEEK4-process-api: schedule
+  case T_IRQ0 + IRQ_IDE:
+    disk_handle();
+    break;
   default: {
     // printf("Get error irq %d\n", ctx->irq);
     assert(ctx->irq >= T_IRQ0 && ctx->irq < T_IRQ0 + NR_INTR);
@@ -2,21 +2,44 @@
 #include "dev.h"
 #include "serial.h"
 #include "fs.h"
+#include "disk.h"
+#include "vme.h"
 
-static int ban_read(void *buf, size_t count) {
+static int ban_read(void *buf, uint32_t count, uint32_t off) {
   return -1;
 }
 
+static int serial_dev_read(void *buf, uint32_t count, uint32_t off) {
+  return serial_read(buf, count); // a stream, no offset
+}
+
 static int ignore_write(const void *buf, size_t count) {
   return count;
 }
 
+static int kheap_read(void *buf, uint32_t count, uint32_t off) {
+  // format: free pages, then free blocks of order 0..KORDER_MAX
+  char str[128];
+  uint32_t nblock[KORDER_MAX + 1];
+  int len = sprintf(str, "%d", kheap_stat(nblock));
+  for (int i = 0; i <= KORDER_MAX; ++i) {
+    len += sprintf(str + len, " %d", nblock[i]);
+  }
+  len += sprintf(str + len, "\n");
+  if (off >= len) return 0;
+  len = MIN(len - off, count);
+  memcpy(buf, str + off, len);
+  return len;
+}
+
 static struct {
   char name[32];
   dev_t dev_op;
 } dev_table[] = {
-  {"/dev/serial", {serial_read, serial_write}},
-  {"/dev/null", {ban_read, ignore_write}}
+  {"/dev/serial", {serial_dev_read, serial_write}},
+  {"/dev/null", {ban_read, ignore_write}},
+  {"/dev/bcache", {bcache_stat, ignore_write}},
+  {"/dev/kheap", {kheap_read, ignore_write}}
 };
 
 #define DEV_NUM (sizeof(dev_table) / sizeof(dev_table[0]))
@@ -1,90 +1,706 @@
 #include "klib.h"
 #include "disk.h"
+#include "sem.h"
+#include "proc.h"
+#include "pci.h"
+#include "vme.h"
+
+#define ATA_DATA    0x1f0
+#define ATA_ERROR   0x1f1
+#define ATA_NSECT   0x1f2
+#define ATA_STATUS  0x1f7
+#define ATA_CMD     0x1f7
+#define ATA_ALTSTAT 0x3f6 // read it won't ack the interrupt
+#define ATA_CTRL    0x3f6
+
+#define ATA_SR_ERR  0x01
+#define ATA_SR_DRQ  0x08
+
+#define ATA_CMD_READ      0x20 // READ SECTORS, one DRQ block per sector
+#define ATA_CMD_WRITE     0x30 // WRITE SECTORS, one DRQ block per sector
+#define ATA_CMD_READ_MUL  0xc4 // READ MULTIPLE, one DRQ block per mult_sects
+#define ATA_CMD_WRITE_MUL 0xc5 // WRITE MULTIPLE, one DRQ block per mult_sects
+#define ATA_CMD_SET_MUL   0xc6 // SET MULTIPLE MODE
+#define ATA_CMD_IDENTIFY  0xec
+#define ATA_CMD_READ_DMA  0xc8
+#define ATA_CMD_WRITE_DMA 0xca
+
+// bus master IDE registers (primary channel), offset to BAR4 of the controller
+#define BM_CMD    0
+#define BM_STATUS 2
+#define BM_PRDT   4
+
+#define BM_CMD_START  0x01
+#define BM_CMD_READ   0x08 // direction: drive to memory
+#define BM_SR_ACTIVE  0x01
+#define BM_SR_ERR     0x02
+#define BM_SR_INTR    0x04
+
+#define PRD_EOT   0x80000000 // last entry of the table
+#define PRD_BOUND 0x10000    // one entry cannot cross 64KiB
+#define PRD_NUM   64
+
+// physical region descriptor
+typedef struct {
+  uint32_t addr;
+  uint32_t count; // byte count in low 16 bits (0 means 64KiB), PRD_EOT at bit 31
+} prd_t;
+
+// sectors moved per DRQ block, 1 means READ/WRITE MULTIPLE is not used
+static int mult_sects = 1;
+
+// io base of bus master registers, 0 means no DMA and always use PIO
+static uint16_t bm_base = 0;
+// the table itself must not cross 64KiB either, aligning it to its size is enough
+static prd_t prdt[PRD_NUM] __attribute__((aligned(sizeof(prd_t) * PRD_NUM)));
 
 static inline void wait_disk() {
-  while ((inb(0x1f7) & 0xc0) != 0x40);
+  while ((inb(ATA_STATUS) & 0xc0) != 0x40);
 }
 
-void read_disk(void *buf, int sect) {
+// IRQ mode: waiters sleep on their bio instead of spinning on status port
+static int disk_irq = 0;
+
+static int can_sleep() {
+  // kernel proc (pid 0) has nobody to switch to during boot, it must poll
+  return disk_irq && proc_curr()->pid != 0;
+}
+
+static void disk_acquire(sem_t *lock) {
+  if (can_sleep()) sem_p(lock);
+}
+
+static void disk_release(sem_t *lock) {
+  if (can_sleep()) sem_v(lock);
+}
+
+static void issue_cmd(int sect, int cnt, int cmd) {
+  // cnt==MAX_SECTS is encoded as 0 in the sector count register
   wait_disk();
-  outb(0x1f2, 1);
+  outb(ATA_NSECT, cnt);
   outb(0x1f3, sect);
   outb(0x1f4, sect >> 8);
   outb(0x1f5, sect >> 16);
   outb(0x1f6, (sect >> 24) | 0xE0);
-  outb(0x1f7, 0x20);
-  wait_disk();
-  for (int i = 0; i < SECTSIZE / 4; i ++) {
-    ((uint32_t *)buf)[i] = inl(0x1f0);
-  }
+  outb(ATA_CMD, cmd);
 }
 
-void write_disk(const void *buf, int sect) {
+static void init_dma() {
+  // find the IDE controller (class 1, subclass 1, e.g. PIIX3 of QEMU),
+  // enable its bus mastering and record the bus master io base from BAR4
+  uint32_t dev;
+  if (pci_find_class(0x01, 0x01, &dev) != 0) return;
+  if (!(pci_read(dev, PCI_CLASS) & (0x80 << 8))) return; // no bus master
+  uint32_t bar = pci_read(dev, PCI_BAR(4));
+  if (!(bar & 1)) return; // should be io space
+  pci_write(dev, PCI_COMMAND, pci_read(dev, PCI_COMMAND) | PCI_CMD_IO | PCI_CMD_MASTER);
+  bm_base = bar & 0xfffc;
+}
+
+static void init_bcache_min();
+
+void init_disk() {
+  // ask the drive how many sectors it can move per DRQ block,
+  // then switch it to the largest power of 2 not above BLK_SIZE
+  uint16_t id[SECTSIZE / 2];
+  init_bcache_min();
+  issue_cmd(0, 0, ATA_CMD_IDENTIFY);
   wait_disk();
-  outb(0x1f2, 1);
-  outb(0x1f3, sect);
-  outb(0x1f4, sect >> 8);
-  outb(0x1f5, sect >> 16);
-  outb(0x1f6, (sect >> 24) | 0xE0);
-  outb(0x1f7, 0x30);
+  if (!(inb(ATA_STATUS) & ATA_SR_DRQ)) return;
+  insl(ATA_DATA, id, SECTSIZE / 4);
+  if (id[49] & (1 << 8)) init_dma(); // drive supports DMA
+  int max = MIN(id[47] & 0xff, BLK_SIZE / SECTSIZE), n = 1;
+  while (n * 2 <= max) n *= 2;
+  if (n == 1) return;
+  issue_cmd(0, n, ATA_CMD_SET_MUL);
   wait_disk();
-  for (int i = 0; i < SECTSIZE / 4; i ++) {
-    outl(0x1f0, ((uint32_t *)buf)[i]);
+  if (!(inb(ATA_STATUS) & ATA_SR_ERR)) mult_sects = n;
+}
+
+// Request queue
+// bio_queue holds pending requests sorted by sector, they are dispatched
+// in C-LOOK order, and continuous requests of same direction are merged
+// into one run served by one ATA command
+
+static bio_t *bio_queue = NULL;
+static uint32_t head_sect = 0; // where the last run ended
+
+// the run in flight, bios chained by next and continuous on disk
+static bio_t *run = NULL;
+static int run_sect, run_cnt, run_done, run_read, run_dma;
+static bio_t *run_bio; // PIO cursor, next DRQ block goes to run_bio->buf + run_off
+static int run_off;
+
+static void run_start();
+
+static int dma_prepare() {
+  // fill prdt with buffers of the run, they are identity mapped (kernel memory),
+  // disk_rw bounces user buffers
+  // return -1 if the run cannot be served by DMA
+  int i = 0;
+  if (bm_base == 0) return -1;
+  for (bio_t *bio = run; bio; bio = bio->next) {
+    uint32_t addr = (uint32_t)bio->buf, end = addr + bio->nsect * SECTSIZE;
+    if ((addr & 1) || end > PHY_MEM) return -1;
+    while (addr < end) {
+      uint32_t n = MIN(end - addr, PRD_BOUND - addr % PRD_BOUND);
+      if (i == PRD_NUM) return -1;
+      prdt[i].addr = addr;
+      prdt[i].count = n & 0xffff;
+      addr += n;
+      i++;
+    }
+  }
+  prdt[i - 1].count |= PRD_EOT;
+  return 0;
+}
+
+static void pio_xfer() {
+  // move the next DRQ block between drive and the buffer of run_bio
+  // it runs in irq under any pgdir, buffers must be kernel memory
+  // only the last bio of a run may end in the middle of a DRQ block
+  int n = MIN(mult_sects, run_cnt - run_done);
+  void *buf = run_bio->buf + run_off;
+  if (run_read) {
+    insl(ATA_DATA, buf, n * SECTSIZE / 4);
+  } else {
+    outsl(ATA_DATA, buf, n * SECTSIZE / 4);
   }
+  run_done += n;
+  run_off += n * SECTSIZE;
+  if (run_off == run_bio->nsect * SECTSIZE && run_bio->next) {
+    run_bio = run_bio->next;
+    run_off = 0;
+  }
+}
+
+static void run_issue() {
+  run_done = 0;
+  run_bio = run;
+  run_off = 0;
+  run_dma = (dma_prepare() == 0);
+  if (run_dma) {
+    int dir = run_read ? BM_CMD_READ : 0;
+    outl(bm_base + BM_PRDT, (uint32_t)prdt);
+    outb(bm_base + BM_CMD, dir);
+    outb(bm_base + BM_STATUS, BM_SR_ERR | BM_SR_INTR); // write 1 to clear
+    issue_cmd(run_sect, run_cnt, run_read ? ATA_CMD_READ_DMA : ATA_CMD_WRITE_DMA);
+    outb(bm_base + BM_CMD, dir | BM_CMD_START);
+    return;
+  }
+  if (run_read) {
+    issue_cmd(run_sect, run_cnt, mult_sects > 1 ? ATA_CMD_READ_MUL : ATA_CMD_READ);
+  } else {
+    issue_cmd(run_sect, run_cnt, mult_sects > 1 ? ATA_CMD_WRITE_MUL : ATA_CMD_WRITE);
+    wait_disk(); // no interrupt before the first DRQ block
+    pio_xfer();
+  }
+}
+
+static void run_finish() {
+  bio_t *bio = run, *next;
+  run = NULL;
+  for (; bio; bio = next) {
+    next = bio->next;
+    bio->finished = 1;
+    // wake every waiter, more than one may wait on a shared bio (e.g. a readahead)
+    for (; bio->waiting > 0; bio->waiting--) {
+      sem_v(&bio->wait);
+    }
+    if (bio->done) bio->done(bio); // bio may be reused after this
+  }
+  run_start();
+}
+
+static void run_start() {
+  // if the drive is idle, pick the first request at or after head_sect,
+  // or wrap to the lowest one, then take the continuous ones after it
+  if (run || !bio_queue) return;
+  bio_t **pp = &bio_queue;
+  while (*pp && (*pp)->sect < head_sect) pp = &(*pp)->next;
+  if (*pp == NULL) pp = &bio_queue;
+  bio_t *first = *pp, *last = first;
+  int cnt = first->nsect;
+  while (last->next && last->next->write == first->write &&
+         last->next->sect == last->sect + last->nsect &&
+         last->nsect % mult_sects == 0 && // DRQ block cannot cross bios
+         cnt + last->next->nsect <= MAX_SECTS) {
+    last = last->next;
+    cnt += last->nsect;
+  }
+  *pp = last->next;
+  last->next = NULL;
+  run = first;
+  run_sect = first->sect;
+  run_cnt = cnt;
+  run_read = !first->write;
+  head_sect = run_sect + cnt;
+  run_issue();
+}
+
+void disk_handle() {
+  // called on IRQ 14 or when polling, advance the run in flight
+  // spurious calls are possible, so check the status before doing anything
+  if (run == NULL) {
+    inb(ATA_STATUS); // ack the drive
+    return;
+  }
+  if (run_dma) {
+    uint8_t st = inb(bm_base + BM_STATUS);
+    if (!(st & BM_SR_INTR)) return;
+    outb(bm_base + BM_CMD, 0);
+    outb(bm_base + BM_STATUS, BM_SR_ERR | BM_SR_INTR);
+    if ((st & BM_SR_ERR) || (inb(ATA_STATUS) & ATA_SR_ERR)) {
+      bm_base = 0; // do not trust it any more, redo the run by PIO
+      run_issue();
+      return;
+    }
+    run_finish();
+    return;
+  }
+  uint8_t st = inb(ATA_STATUS);
+  if (st & 0x80) return; // still busy
+  panic_on(st & ATA_SR_ERR, "disk error");
+  if (run_done < run_cnt) {
+    if (!(st & ATA_SR_DRQ)) return;
+    pio_xfer();
+    // a write is done at the interrupt after its last block
+    if (!run_read || run_done < run_cnt) return;
+  }
+  run_finish();
+}
+
+void init_disk_irq() {
+  outb(ATA_CTRL, 0); // clear nIEN, let drive raise IRQ 14
+  disk_irq = 1;
+}
+
+void bio_init(bio_t *bio, void *buf, uint32_t sect, uint32_t nsect, int write) {
+  bio->buf = buf;
+  bio->sect = sect;
+  bio->nsect = nsect;
+  bio->write = write;
+  bio->done = NULL;
+  bio->priv = NULL;
+  bio->finished = 0;
+  bio->waiting = 0;
+  bio->next = NULL;
+  sem_init(&bio->wait, 0);
+}
+
+void bio_submit(bio_t *bio) {
+  // queue bio and return at once, bio->done is called when it is finished
+  assert(bio->nsect > 0 && bio->nsect <= MAX_SECTS);
+  bio->finished = 0;
+  bio_t **pp = &bio_queue;
+  while (*pp && (*pp)->sect <= bio->sect) pp = &(*pp)->next;
+  bio->next = *pp;
+  *pp = bio;
+  run_start();
+}
+
+void bio_wait(bio_t *bio) {
+  // sleep until the IRQ finishes bio, or drive the drive by polling
+  while (!bio->finished) {
+    if (can_sleep()) {
+      bio->waiting++;
+      sem_p(&bio->wait);
+    } else {
+      wait_disk();
+      disk_handle();
+    }
+  }
+}
+
+#define BOUNCE_ORDER 5 // 2^5 pages hold MAX_SECTS sectors
+
+static void disk_rw(void *buf, int sect, int cnt, int write);
+
+static void disk_rw_bounce(void *buf, int sect, int cnt, int write) {
+  // buf is not kernel memory (a user va), but the run is moved in irq,
+  // maybe when another pgdir is loaded, so copy it via kernel pages here
+  static_assert((PGSIZE << BOUNCE_ORDER) == MAX_SECTS * SECTSIZE, "bounce holds a run");
+  int order = BOUNCE_ORDER;
+  void *bounce = kalloc_order(order);
+  if (bounce == NULL) {
+    order = 0;
+    bounce = kalloc();
+  }
+  int max = (PGSIZE << order) / SECTSIZE;
+  for (int done = 0; done < cnt; ) {
+    int n = MIN(cnt - done, max);
+    if (write) memcpy(bounce, buf + done * SECTSIZE, n * SECTSIZE);
+    disk_rw(bounce, sect + done, n, write);
+    if (!write) memcpy(buf + done * SECTSIZE, bounce, n * SECTSIZE);
+    done += n;
+  }
+  kfree_order(bounce, order);
+}
+
+static void disk_rw(void *buf, int sect, int cnt, int write) {
+  bio_t bio;
+  if ((size_t)buf + cnt * SECTSIZE > PHY_MEM) {
+    disk_rw_bounce(buf, sect, cnt, write);
+    return;
+  }
+  bio_init(&bio, buf, sect, cnt, write);
+  bio_submit(&bio);
+  bio_wait(&bio);
+}
+
+void read_disk_multi(void *buf, int sect, int cnt) {
+  // read cnt (1..MAX_SECTS) continuous sectors from sect with one command
+  disk_rw(buf, sect, cnt, 0);
+}
+
+void write_disk_multi(const void *buf, int sect, int cnt) {
+  // write cnt (1..MAX_SECTS) continuous sectors to sect with one command
+  disk_rw((void *)buf, sect, cnt, 1);
+}
+
+void read_disk(void *buf, int sect) {
+  read_disk_multi(buf, sect, 1);
+}
+
+void write_disk(const void *buf, int sect) {
+  write_disk_multi(buf, sect, 1);
 }
 
 void copy_from_disk(void *buf, int nbytes, int disk_offset) {
-  uint32_t cur  = (uint32_t)buf;
-  uint32_t ed   = (uint32_t)buf + nbytes;
-  uint32_t sect = (disk_offset / SECTSIZE);
-  for(; cur < ed; cur += SECTSIZE, sect ++)
-    read_disk((void *)cur, sect);
+  // one command per MAX_SECTS sectors instead of one per sector
+  int sect = disk_offset / SECTSIZE;
+  int left = (nbytes + SECTSIZE - 1) / SECTSIZE;
+  while (left > 0) {
+    int n = MIN(left, MAX_SECTS);
+    read_disk_multi(buf, sect, n);
+    buf += n * SECTSIZE;
+    sect += n;
+    left -= n;
+  }
 }
 
 void copy_to_disk(const void *buf, int nbytes, int disk_offset) {
-  uint32_t cur  = (uint32_t)buf;
-  uint32_t ed   = (uint32_t)buf + nbytes;
-  uint32_t sect = (disk_offset / SECTSIZE);
-  for(; cur < ed; cur += SECTSIZE, sect ++)
-    write_disk((const void *)cur, sect);
+  int sect = disk_offset / SECTSIZE;
+  int left = (nbytes + SECTSIZE - 1) / SECTSIZE;
+  while (left > 0) {
+    int n = MIN(left, MAX_SECTS);
+    write_disk_multi(buf, sect, n);
+    buf += n * SECTSIZE;
+    sect += n;
+    left -= n;
+  }
 }
 
-#define BCACHE_NUM 16
+// Block cache
+// blocks are found by hash of their no, and replaced in LRU order among
+// the unpinned ones, the cache starts with BCACHE_MIN static buffers and
+// grows with kalloc at init_bcache
 
-typedef struct {
-  int valid, no;
-  uint8_t buf[BLK_SIZE];
-} bcache_t;
+#define BCACHE_MIN 16
+#define BCACHE_MAX 2048
+#define BHASH_NUM  1024
+
+struct buf {
+  uint32_t no;   // BLK_INVALID if not used yet
+  int valid;     // data is loaded
+  int ref;       // pinned by bget, cannot be replaced while ref>0
+  int dirty;     // modified but not written back yet
+  int io;        // async read or write back in flight, bio is in use
+  int hold;      // held by fs log, must not be written back until released
+  sem_t lock;    // held while loading
+  bio_t bio;     // for async write back
+  struct buf *hnext;       // hash chain
+  struct buf *prev, *next; // LRU list, lru.next is the most recently used
+  uint8_t *data;
+};
+
+#define BLK_INVALID ((uint32_t)-1)
+
+static buf_t bufs[BCACHE_MAX];
+static int nbuf = 0;
+static uint8_t bdata_min[BCACHE_MIN][BLK_SIZE];
+static buf_t *bhash[BHASH_NUM];
+static buf_t lru;
+static struct {
+  uint32_t hit, miss, evict;
+} bc_stat;
+
+static void lru_remove(buf_t *b) {
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+}
+
+static void lru_push(buf_t *b) {
+  b->prev = &lru;
+  b->next = lru.next;
+  lru.next->prev = b;
+  lru.next = b;
+}
+
+static void badd(uint8_t *data) {
+  assert(nbuf < BCACHE_MAX);
+  buf_t *b = &bufs[nbuf++];
+  b->no = BLK_INVALID;
+  b->valid = b->ref = b->dirty = b->io = b->hold = 0;
+  b->data = data;
+  b->hnext = NULL;
+  sem_init(&b->lock, 1);
+  lru.prev->next = b; // new buffer is the first to be used
+  b->prev = lru.prev;
+  b->next = &lru;
+  lru.prev = b;
+}
+
+static void init_bcache_min() {
+  lru.prev = lru.next = &lru;
+  for (int i = 0; i < BCACHE_MIN; ++i) {
+    badd(bdata_min[i]);
+  }
+}
+
+void init_bcache() {
+  // grow the cache to 1/16 of the kernel heap (free memory at boot)
+  int n = MIN((PHY_MEM - KER_MEM) / PGSIZE / 16, BCACHE_MAX);
+  static_assert(BLK_SIZE == PGSIZE, "one page per buffer");
+  while (nbuf < n) {
+    badd(kalloc());
+  }
+}
+
+static void bhash_remove(buf_t *b) {
+  buf_t **pp = &bhash[b->no % BHASH_NUM];
+  while (*pp != b) pp = &(*pp)->hnext;
+  *pp = b->hnext;
+}
+
+static buf_t *bvictim() {
+  // the least recently used one which is not pinned, NULL if none
+  for (buf_t *b = lru.prev; b != &lru; b = b->prev) {
+    if (b->ref == 0) return b;
+  }
+  return NULL;
+}
+
+static void brebind(buf_t *b, uint32_t no) {
+  // reuse the unpinned and clean b for blk no
+  if (b->no != BLK_INVALID) {
+    if (b->valid) bc_stat.evict++;
+    bhash_remove(b);
+  }
+  b->no = no;
+  b->valid = 0;
+  b->hnext = bhash[no % BHASH_NUM];
+  bhash[no % BHASH_NUM] = b;
+}
+
+static buf_t *bgetblk_wait(buf_t *b, int load) {
+  while (!b->valid && b->io) {
+    bio_wait(&b->bio); // being prefetched, just wait for it
+  }
+  if (!b->valid && load) {
+    // someone may be loading it, wait for him
+    disk_acquire(&b->lock);
+    if (!b->valid) {
+      copy_from_disk(b->data, BLK_SIZE, b->no * BLK_SIZE);
+      b->valid = 1;
+    }
+    disk_release(&b->lock);
+  }
+  return b;
+}
 
-static bcache_t blk_cache[BCACHE_NUM];
+static void bwriteback(buf_t *b) {
+  // write b back synchronously, keep it pinned meanwhile, but do not
+  // touch its LRU position, so it is the victim again once it is clean
+  b->ref++;
+  b->dirty = 0; // if it is modified during io, it will be dirty again
+  copy_to_disk(b->data, BLK_SIZE, b->no * BLK_SIZE);
+  b->ref--;
+}
 
-static bcache_t *bgetcache(uint32_t no) {
-  bcache_t *bc = &blk_cache[no % BCACHE_NUM];
-  if (bc->valid == 0 || bc->no != no) {
-    copy_from_disk(bc->buf, BLK_SIZE, no * BLK_SIZE);
-    bc->valid = 1;
-    bc->no = no;
+static buf_t *bgetblk(uint32_t no, int load) {
+  buf_t *b;
+  for (b = bhash[no % BHASH_NUM]; b; b = b->hnext) {
+    if (b->no == no) break;
+  }
+  if (b) {
+    bc_stat.hit++;
+  } else {
+    bc_stat.miss++;
+    // write back a dirty victim first, then search again since we may sleep
+    while ((b = bvictim()) && b->dirty) {
+      bwriteback(b);
+    }
+    panic_on(b == NULL, "no free block cache");
+    for (buf_t *p = bhash[no % BHASH_NUM]; p; p = p->hnext) {
+      if (p->no == no) {
+        // loaded by others when we were writing back
+        p->ref++;
+        return bgetblk_wait(p, load);
+      }
+    }
+    brebind(b, no);
   }
-  return bc;
+  b->ref++;
+  return bgetblk_wait(b, load);
+}
+
+buf_t *bget(uint32_t no) {
+  // pin blk no in the cache (load it if need), call bput after use
+  return bgetblk(no, 1);
+}
+
+void *bdata(buf_t *b) {
+  return b->data;
+}
+
+void bdirty(buf_t *b) {
+  // data of pinned b is modified in place
+  b->dirty = 1;
+}
+
+void bput(buf_t *b) {
+  assert(b->ref > 0);
+  if (--b->ref == 0) {
+    lru_remove(b);
+    lru_push(b);
+  }
+}
+
+uint32_t bno(buf_t *b) {
+  return b->no;
+}
+
+void bhold(buf_t *b) {
+  // pin b and keep it from write back, it is in a transaction not committed yet
+  b->ref++;
+  b->hold = 1;
+}
+
+void bunhold(buf_t *b) {
+  // transaction is committed, b can go home now
+  b->hold = 0;
+  bput(b);
+}
+
+int bcache_size() {
+  return nbuf;
+}
+
+int bcache_stat(void *buf, uint32_t count, uint32_t off) {
+  // read by /dev/bcache, format: nbuf hit miss evict
+  // the text is read from off, 0 at its end, so cat stops
+  char str[64];
+  int len = sprintf(str, "%d %d %d %d\n", nbuf, bc_stat.hit, bc_stat.miss, bc_stat.evict);
+  if (off >= len) return 0;
+  len = MIN(len - off, count);
+  memcpy(buf, str + off, len);
+  return len;
 }
 
 void bread(void *dst, uint32_t size, uint32_t no, uint32_t off) {
   // read blk no's [off, off+size) to dst, promise off+size<=BLK_SIZE
   assert(size + off <= BLK_SIZE);
-  bcache_t *bc = bgetcache(no);
-  memcpy(dst, &bc->buf[off], size);
+  buf_t *b = bget(no);
+  memcpy(dst, &b->data[off], size);
+  bput(b);
 }
 
 void bwrite(const void *src, uint32_t size, uint32_t no, uint32_t off) {
   // write src to blk no's [off, off+size), promise off+size<=BLK_SIZE
   assert(size + off <= BLK_SIZE);
-  bcache_t *bc = bgetcache(no);
-  memcpy(&bc->buf[off], src, size);
-  copy_to_disk(bc->buf, BLK_SIZE, no * BLK_SIZE);
+  buf_t *b = bget(no);
+  memcpy(&b->data[off], src, size);
+  b->dirty = 1; // written back by flusher, sync or eviction
+  bput(b);
 }
 
 void bzero(uint32_t no) {
-  bcache_t *bc = bgetcache(no);
-  memset(bc->buf, 0, BLK_SIZE);
-  copy_to_disk(bc->buf, BLK_SIZE, no * BLK_SIZE);
+  // no need to load it, all of it is overwritten
+  buf_t *b = bgetblk(no, 0);
+  disk_acquire(&b->lock); // do not race with someone loading it
+  memset(b->data, 0, BLK_SIZE);
+  b->valid = 1;
+  b->dirty = 1;
+  disk_release(&b->lock);
+  bput(b);
+}
+
+static void bwb_done(bio_t *bio) {
+  buf_t *b = bio->priv;
+  b->io = 0;
+  bput(b);
+}
+
+static int bflush() {
+  // start async write back of all dirty buffers, the queue sorts and
+  // merges them, so adjacent dirty blocks go to disk in one command
+  // return how many dirty ones are skipped since a write back is in flight
+  int busy = 0;
+  for (int i = 0; i < nbuf; ++i) {
+    buf_t *b = &bufs[i];
+    if (!b->dirty || b->hold) continue;
+    if (b->io) {
+      busy++;
+      continue;
+    }
+    b->ref++;
+    b->io = 1;
+    b->dirty = 0;
+    bio_init(&b->bio, b->data, b->no * (BLK_SIZE / SECTSIZE), BLK_SIZE / SECTSIZE, 1);
+    b->bio.done = bwb_done;
+    b->bio.priv = b;
+    bio_submit(&b->bio);
+  }
+  return busy;
+}
+
+void bsync() {
+  // write back all dirty buffers (except held ones) and wait for them
+  // another sync or the flusher may have a write back of the same buffer in
+  // flight, wait for it with them, then write it again if it is still dirty
+  int busy;
+  do {
+    busy = bflush();
+    for (int i = 0; i < nbuf; ++i) {
+      if (bufs[i].io) bio_wait(&bufs[i].bio);
+    }
+  } while (busy > 0);
+}
+
+static void bra_done(bio_t *bio) {
+  buf_t *b = bio->priv;
+  b->valid = 1;
+  b->io = 0;
+  bput(b);
+}
+
+void bprefetch(uint32_t no) {
+  // start loading blk no into the cache without waiting for it
+  // give up if it needs a write back to get a free buffer
+  for (buf_t *p = bhash[no % BHASH_NUM]; p; p = p->hnext) {
+    if (p->no == no) return;
+  }
+  buf_t *b = bvictim();
+  if (b == NULL || b->dirty) return;
+  brebind(b, no);
+  b->ref++;
+  b->io = 1;
+  bio_init(&b->bio, b->data, no * (BLK_SIZE / SECTSIZE), BLK_SIZE / SECTSIZE, 0);
+  b->bio.done = bra_done;
+  b->bio.priv = b;
+  bio_submit(&b->bio);
+}
+
+#define FLUSH_TICKS 300 // 3s at HZ 100
+
+void bflush_tick(uint32_t tick) {
+  // called by timer, cannot sleep here, so only start the write back
+  // when irq drives the queue, otherwise flush synchronously by polling
+  if (tick % FLUSH_TICKS != 0) return;
+  if (disk_irq) {
+    bflush();
+  } else {
+    bsync();
+  }
 }
@@ -1,5 +1,6 @@
 #include "klib.h"
 #include "file.h"
+#include "disk.h"
 
 #define TOTAL_FILE 128
 
@@ -33,6 +34,7 @@ file_t *fopen(const char *path, int mode) {
     fp->type = TYPE_FILE; // file_t don't and needn't distingush between file and dir
     fp->inode = ip;
     fp->offset = 0;
+    fp->ra_next = fp->ra_win = fp->ra_end = 0;
   } else if (type == TYPE_DEV) {
     fp->type = TYPE_DEV;
     fp->dev_op = dev_get(idevid(ip));
@@ -48,11 +50,44 @@ bad:
   return NULL;
 }
 
+#define RA_MIN 4  // blocks
+#define RA_MAX 32
+
+static void freadahead(file_t *file, uint32_t size) {
+  // called before reading [offset, offset+size)
+  uint32_t off = file->offset;
+  if (size == 0) return;
+  if (off != file->ra_next) {
+    // random access, stop read ahead
+    file->ra_win = file->ra_end = 0;
+  } else {
+    file->ra_win = file->ra_win ? MIN(file->ra_win * 2, RA_MAX) : RA_MIN;
+  }
+  file->ra_next = off + size;
+  if (file->ra_win == 0) return;
+  uint32_t next = (off + size - 1) / BLK_SIZE + 1; // first blk after this read
+  // still more than half a window ahead, nothing to do
+  if (file->ra_end > next + file->ra_win / 2) return;
+  uint32_t start = MAX(file->ra_end, next);
+  file->ra_end = next + file->ra_win;
+  ireadahead(file->inode, start, file->ra_end - start);
+}
+
 int fread(file_t *file, void *buf, uint32_t size) {
   // Lab3-1, distribute read operation by file's type
   // remember to add offset if type is FILE (check if iread return value >= 0!)
   if (!file->readable) return -1;
-  TODO();
+  if (file->type == TYPE_DEV) {
+    // offset only matters to devs with content, e.g. /dev/bcache
+    int n = file->dev_op->read(buf, size, file->offset);
+    if (n >= 0) file->offset += n;
+    return n;
+  }
+  assert(file->type == TYPE_FILE);
+  freadahead(file, size);
+  int n = iread(file->inode, file->offset, buf, size);
+  if (n >= 0) file->offset += n;
+  return n;
 }
 
 int fwrite(file_t *file, const void *buf, uint32_t size) {
@@ -2,6 +2,7 @@
 #include "fs.h"
 #include "disk.h"
 #include "proc.h"
+#include "timer.h"
 
 #ifdef EASY_FS
 
@@ -50,18 +51,34 @@ int iread(inode_t *inode, uint32_t off, void *buf, uint32_t len) {
   assert(inode);
   char *cbuf = buf;
   char dbuf[SECTSIZE];
-  uint32_t curr = -1;
   uint32_t total_len = inode->dinode.length;
   uint32_t st_sect = inode->dinode.start_sect;
-  int i;
-  for (i = 0; i < len && off < total_len; ++i, ++off) {
-    if (curr != off / SECTSIZE) {
-      read_disk(dbuf, st_sect + off / SECTSIZE);
-      curr = off / SECTSIZE;
-    }
-    *cbuf++ = dbuf[off % SECTSIZE];
+  if (off >= total_len) return 0;
+  len = MIN(len, total_len - off);
+  uint32_t end = off + len, n;
+  if (off % SECTSIZE) {
+    // unaligned head, through dbuf
+    read_disk(dbuf, st_sect + off / SECTSIZE);
+    n = MIN(SECTSIZE - off % SECTSIZE, end - off);
+    memcpy(cbuf, &dbuf[off % SECTSIZE], n);
+    cbuf += n; off += n;
   }
-  return i;
+  // whole sectors go straight to buf, file is continuous on disk
+  n = (end - off) / SECTSIZE * SECTSIZE;
+  if (n) {
+    copy_from_disk(cbuf, n, (st_sect + off / SECTSIZE) * SECTSIZE);
+    cbuf += n; off += n;
+  }
+  if (off < end) {
+    // partial tail, through dbuf
+    read_disk(dbuf, st_sect + off / SECTSIZE);
+    memcpy(cbuf, dbuf, end - off);
+  }
+  return len;
+}
+
+void ireadahead(inode_t *inode, uint32_t blk, uint32_t n) {
+  // file is continuous on disk and iread reads it with one command
 }
 
 void iadddev(const char *name, int id) {
@@ -103,6 +120,36 @@ inode_t *idup(inode_t *inode) {
 
 void iclose(inode_t *inode) { /* do nothing */ }
 
+void init_icache() { /* do nothing */ }
+
+void init_pcache() { /* do nothing */ }
+
+fpage_t *pget(inode_t *inode, uint32_t pgno) {
+  return NULL;
+}
+
+void *pdata(fpage_t *page) {
+  return NULL;
+}
+
+void pput(fpage_t *page) { /* do nothing */ }
+
+fpage_t *plookup(void *data) {
+  return NULL;
+}
+
+void pflush(inode_t *inode, fpage_t *page) { /* do nothing */ }
+
+void isync() { /* do nothing */ }
+
+void isync_tick() { /* do nothing */ }
+
+void isync_due() { /* do nothing */ }
+
+int ipageable(inode_t *inode) {
+  return -1; // no page cache
+}
+
 int iremove(const char *path) {
   panic("remove doesn't support");
 }
@@ -114,37 +161,106 @@ int iremove(const char *path) {
 
 #define NDIRECT   12
 #define NINDIRECT (BLK_SIZE / sizeof(uint32_t))
+#define NLEVEL    3 // single, double and triple indirect
 
 #define IPERBLK   (BLK_SIZE / sizeof(dinode_t)) // inode num per blk
 
+#define FEAT_EXTENT  0x1 // new inodes use extent tree
+#define FEAT_DIRHASH 0x2 // big dirs get a hash index
+#define FEAT_INLINE  0x4 // new files and dirs keep small data in dinode
+
 // super block
 typedef struct super_block {
-  uint32_t bitmap; // block num of bitmap
-  uint32_t istart; // start block no of inode blocks
-  uint32_t inum;   // total inode num
-  uint32_t root;   // inode no of root dir
+  uint32_t bitmap;   // block num of bitmap
+  uint32_t istart;   // start block no of inode blocks
+  uint32_t inum;     // total inode num
+  uint32_t root;     // inode no of root dir
+  uint32_t features; // FEAT_*
+  uint32_t logstart; // block no of log header, log blocks follow it
+  uint32_t nlog;     // block num of log (header included), 0 if no log
 } sb_t;
 
+// Extent tree, the root lives in dinode, other nodes are blocks.
+// An entry of leaf (depth 0) maps file blocks [lblk, lblk+len) to disk
+// blocks [start, start+len), an entry of index node points to the child
+// node start which covers file blocks from lblk.
+typedef struct {
+  uint16_t n;     // entries used
+  uint16_t depth; // 0 for leaf
+} ext_hdr_t;
+
+typedef struct {
+  uint32_t lblk;  // first file block it covers
+  uint32_t start; // first disk block (leaf) or child node block (index)
+  uint32_t len;   // block num, leaf only
+} extent_t;
+
+#define EXT_ROOT_NUM  4
+#define EXT_NODE_NUM  ((BLK_SIZE - sizeof(ext_hdr_t)) / sizeof(extent_t))
+#define EXT_MAX_DEPTH 4
+
+typedef struct {
+  ext_hdr_t hdr;
+  extent_t e[EXT_ROOT_NUM];
+} ext_root_t;
+
+typedef struct {
+  ext_hdr_t hdr;
+  extent_t e[EXT_NODE_NUM];
+} ext_node_t;
+
+#define DI_EXTENT 0x1 // data is mapped by ext instead of addrs
+#define DI_INDEX  0x2 // hash index of a dir, its data is metadata
+#define DI_INLINE 0x4 // data is in dinode itself, no data block
+
+#define INLINE_MAX 228 // bytes of inline data, makes dinode 256 bytes
+
 // On disk inode
 typedef struct dinode {
   uint32_t type;   // file type
   uint32_t device; // if it is a dev, its dev_id
   uint32_t size;   // file size
-  uint32_t addrs[NDIRECT + 1]; // data block addresses, 12 direct and 1 indirect
+  uint32_t flags;  // DI_*
+  union {
+    uint32_t addrs[NDIRECT + NLEVEL]; // data block addresses, 12 direct, 1 indirect, 1 double and 1 triple indirect
+    ext_root_t ext;                   // if flags & DI_EXTENT
+    uint8_t data[INLINE_MAX];         // if flags & DI_INLINE
+  };
+  uint32_t hidx;  // dir only, inode no of its hash index, 0 if none
+  uint32_t hused; // dir only, used slots of hash index, deleted ones included
+  uint32_t hfree; // dir only, first free dirent index + 1 of a hashed dir, 0 if none
 } dinode_t;
 
 struct inode {
-  int no;
+  int no; // 0 if unused
   int ref;
   int del;
+  int valid; // dinode is loaded
+  int locked; // dir only, a create or remove in it is in progress, see dlock
+  int waiting; // procs waiting for it to be loaded or unlocked
+  sem_t wait;
+  struct inode *hnext, *prev, *next; // hash chain and free list
+  uint32_t da_lblk, da_n; // delayed blocks [da_lblk, da_lblk+da_n)
   dinode_t dinode;
 };
 
 #define SUPER_BLOCK 32
 static sb_t sb;
 
+static void init_dcache();
+static void init_icache_min();
+static void init_fmap();
+static void init_log();
+
 void init_fs() {
+  static_assert(BLK_SIZE % sizeof(dinode_t) == 0, "sizeof inode should divide BLK_SIZE");
+  static_assert(sizeof(ext_root_t) <= sizeof(uint32_t) * (NDIRECT + NLEVEL), "ext root should fit addrs");
+  static_assert(sizeof(ext_node_t) <= BLK_SIZE, "ext node should fit a block");
   bread(&sb, sizeof(sb), SUPER_BLOCK, 0);
+  init_log(); // replay it before anyone reads metadata
+  init_dcache();
+  init_icache_min();
+  init_fmap();
 }
 
 #define I2BLKNO(no)  (sb.istart + no / IPERBLK)
@@ -154,58 +270,410 @@ static void diread(dinode_t *di, uint32_t no) {
   bread(di, sizeof(dinode_t), I2BLKNO(no), I2BLKOFF(no));
 }
 
+// Write-ahead log of metadata. Blocks modified in an op (create, remove,
+// trunc) are held in block cache instead of written back. Ops are batched
+// and committed together (group commit): held blocks go to the log in one
+// sequential write, then the header with their home block nos (commit
+// point), then they are written home and the header is cleared.
+// init_fs replays a committed header, so an op is all or nothing.
+// Only the metadata and dirs are logged, regular file data is not.
+#define LOG_MAX      127 // blocks of a batch, header is one sector
+#define LOG_OPMAX    24  // blocks an op may touch
+#define COMMIT_TICKS 500 // commit a batch once it is 5s old at HZ 100
+
+typedef struct {
+  uint32_t n;
+  uint32_t blk[LOG_MAX]; // home block no of log block i
+} log_hdr_t;
+
+static struct {
+  uint32_t cap;     // blocks a batch can hold, 0 if no log
+  int outstanding;  // ops in progress
+  int committing;
+  int waiting;      // ops waiting for a commit
+  sem_t wait;
+  uint32_t tick;    // when the batch started
+  int due;          // batch is old, set by timer, committed in process context
+  log_hdr_t hdr;
+  buf_t *bufs[LOG_MAX];
+  bio_t bios[LOG_MAX];
+} journal;
+
+#define LOG_SECT(i) ((sb.logstart + (i)) * (BLK_SIZE / SECTSIZE))
+
+static void init_log() {
+  static_assert(sizeof(log_hdr_t) == SECTSIZE, "log header should be one sector");
+  sem_init(&journal.wait, 0);
+  if (sb.nlog == 0) return;
+  read_disk(&journal.hdr, LOG_SECT(0));
+  if (journal.hdr.n == 0) return;
+  // crashed after commit, copy the blocks home again
+  for (uint32_t i = 0; i < journal.hdr.n; ++i) {
+    buf_t *b = bget(journal.hdr.blk[i]);
+    copy_from_disk(bdata(b), BLK_SIZE, (sb.logstart + 1 + i) * BLK_SIZE);
+    bdirty(b);
+    bput(b);
+  }
+  bsync();
+  journal.hdr.n = 0;
+  write_disk(&journal.hdr, LOG_SECT(0));
+}
+
+static uint32_t log_cap() {
+  // held blocks stay pinned, so use half of the block cache at most,
+  // no log if it cannot hold an op
+  uint32_t cap = MIN(MIN(sb.nlog - 1, LOG_MAX), bcache_size() / 2);
+  return sb.nlog && cap >= LOG_OPMAX ? cap : 0;
+}
+
+static void log_commit() {
+  uint32_t n = journal.hdr.n;
+  journal.committing = 1;
+  for (uint32_t i = 0; i < n; ++i) {
+    // log blocks are adjacent, the queue merges them to one command
+    bio_init(&journal.bios[i], bdata(journal.bufs[i]), LOG_SECT(1 + i), BLK_SIZE / SECTSIZE, 1);
+    bio_submit(&journal.bios[i]);
+  }
+  for (uint32_t i = 0; i < n; ++i) {
+    bio_wait(&journal.bios[i]);
+  }
+  write_disk(&journal.hdr, LOG_SECT(0)); // commit point
+  for (uint32_t i = 0; i < n; ++i) {
+    bunhold(journal.bufs[i]);
+  }
+  bsync(); // install them, with other dirty blocks
+  journal.hdr.n = 0;
+  write_disk(&journal.hdr, LOG_SECT(0));
+  journal.due = 0;
+  journal.committing = 0;
+  for (; journal.waiting > 0; journal.waiting--) {
+    sem_v(&journal.wait);
+  }
+}
+
+static void log_sync() {
+  // commit the batch now if no op is in progress
+  if (journal.outstanding == 0 && !journal.committing && journal.hdr.n > 0) {
+    log_commit();
+  }
+}
+
+static void log_begin() {
+  // start an op, wait if the batch may not have room for it
+  // ops can nest, only the outermost one counts
+  if (proc_curr()->logop++ > 0) return;
+  if (journal.due) log_sync();
+  while (1) {
+    journal.cap = log_cap();
+    if (journal.cap == 0) break;
+    if (!journal.committing &&
+        journal.hdr.n + (journal.outstanding + 1) * LOG_OPMAX <= journal.cap) break;
+    if (!journal.committing && journal.outstanding == 0) {
+      log_commit();
+    } else {
+      journal.waiting++;
+      sem_p(&journal.wait);
+    }
+  }
+  journal.outstanding++;
+}
+
+static void log_end() {
+  // end an op, commit the batch if it is full, old, or someone waits for it
+  if (--proc_curr()->logop > 0) return;
+  if (--journal.outstanding > 0 || journal.hdr.n == 0) return;
+  if (journal.waiting || journal.hdr.n + LOG_OPMAX > journal.cap ||
+      get_tick() - journal.tick >= COMMIT_TICKS) {
+    log_commit();
+  }
+}
+
+static void log_add(buf_t *b) {
+  // b is going to be modified by current op, hold it in the batch
+  if (journal.cap == 0 || proc_curr()->logop == 0) return;
+  for (uint32_t i = 0; i < journal.hdr.n; ++i) {
+    if (journal.hdr.blk[i] == bno(b)) return;
+  }
+  // log_begin keeps LOG_OPMAX blocks for each op, bigger work is split
+  // into several ops (see dhash_build), so the batch never overflows
+  assert(journal.hdr.n < journal.cap);
+  if (journal.hdr.n == 0) journal.tick = get_tick();
+  bhold(b);
+  journal.bufs[journal.hdr.n] = b;
+  journal.hdr.blk[journal.hdr.n++] = bno(b);
+}
+
+// bwrite, bdirty and bzero for metadata, they go through the log
+static void lbwrite(const void *src, uint32_t size, uint32_t no, uint32_t off) {
+  buf_t *b = bget(no);
+  log_add(b);
+  memcpy(bdata(b) + off, src, size);
+  bdirty(b);
+  bput(b);
+}
+
+static void lbdirty(buf_t *b) {
+  log_add(b);
+  bdirty(b);
+}
+
+static void lbzero(uint32_t no) {
+  bzero(no);
+  buf_t *b = bget(no);
+  log_add(b);
+  bput(b);
+}
+
 static void diwrite(const dinode_t *di, uint32_t no) {
-  bwrite(di, sizeof(dinode_t), I2BLKNO(no), I2BLKOFF(no));
+  lbwrite(di, sizeof(dinode_t), I2BLKNO(no), I2BLKOFF(no));
+}
+
+// In memory free maps of blocks and inodes, a set bit means used.
+// Words are grouped with a free count per group so full groups are
+// skipped, search starts from the goal, or where the last one ended.
+#define FM_GROUP  32 // words per group
+#define IMAP_MAX  8192
+
+// Block groups are the groups of block map, inodes are split into the
+// same number of groups, inode group g keeps its data in block group g.
+#define BG_BLKS (FM_GROUP * 32)
+#define BG_NUM  (BLK_NUM / BG_BLKS)
+#define IGROUP(no)     ((no) * BG_NUM / sb.inum)
+#define GROUP_INODE(g) (((g) * sb.inum + BG_NUM - 1) / BG_NUM) // first inode of group g
+
+typedef struct {
+  uint32_t *map;
+  uint16_t *gfree;  // free bits per group
+  uint32_t nword;
+  uint32_t cursor;  // word to start next search
+} fmap_t;
+
+static uint32_t bmap_words[BLK_NUM / 32], imap_words[IMAP_MAX / 32];
+static uint16_t bmap_gfree[BG_NUM], imap_gfree[IMAP_MAX / 32 / FM_GROUP];
+static fmap_t bmap = {bmap_words, bmap_gfree, BLK_NUM / 32, 0};
+static fmap_t imap = {imap_words, imap_gfree, 0, 0};
+
+static void fmap_count(fmap_t *fm) {
+  for (uint32_t w = 0; w < fm->nword; ++w) {
+    if (w % FM_GROUP == 0) fm->gfree[w / FM_GROUP] = 0;
+    for (uint32_t x = ~fm->map[w]; x; x &= x - 1) {
+      fm->gfree[w / FM_GROUP]++;
+    }
+  }
+}
+
+static uint32_t fmap_take(fmap_t *fm, uint32_t w, uint32_t bit) {
+  fm->map[w] |= 1u << bit;
+  fm->gfree[w / FM_GROUP]--;
+  fm->cursor = w;
+  return w * 32 + bit;
+}
+
+static uint32_t fmap_alloc(fmap_t *fm, uint32_t goal) {
+  // find a free bit, set it and return its index, -1 if none
+  // goal is the preferred index, -1 if any, the first free one
+  // at or after goal in its word is taken, otherwise search on from there
+  uint32_t w = fm->cursor;
+  if (goal != -1 && goal / 32 < fm->nword) {
+    w = goal / 32;
+    uint32_t free = ~fm->map[w] & (0xffffffff << (goal % 32));
+    if (free) return fmap_take(fm, w, bsf(free));
+  }
+  for (uint32_t n = 0; n < fm->nword; ) {
+    if (fm->gfree[w / FM_GROUP] == 0) {
+      // the whole group is used up, skip the rest of it
+      n += FM_GROUP - w % FM_GROUP;
+      w += FM_GROUP - w % FM_GROUP;
+    } else if (fm->map[w] == 0xffffffff) {
+      n++;
+      w++;
+    } else {
+      return fmap_take(fm, w, bsf(~fm->map[w]));
+    }
+    if (w >= fm->nword) w = 0;
+  }
+  return -1;
 }
 
-static uint32_t dialloc(int type) {
+static void fmap_free(fmap_t *fm, uint32_t idx) {
+  assert(fm->map[idx / 32] & (1u << (idx % 32)));
+  fm->map[idx / 32] &= ~(1u << (idx % 32));
+  fm->gfree[idx / 32 / FM_GROUP]++;
+}
+
+static void init_fmap() {
+  // block map is the bitmap block, inode map is built by scanning the inode blocks
+  bread(bmap.map, sizeof bmap_words, sb.bitmap, 0);
+  fmap_count(&bmap);
+  assert(sb.inum <= IMAP_MAX);
+  imap.nword = (sb.inum + 31) / 32;
+  for (uint32_t i = sb.inum; i < imap.nword * 32; ++i) {
+    imap.map[i / 32] |= 1u << (i % 32); // not exist, mark used
+  }
+  imap.map[0] |= 1; // first (0th) inode always unused
+  for (uint32_t i = 0; i < sb.inum; i += IPERBLK) {
+    buf_t *b = bget(I2BLKNO(i));
+    dinode_t *di = bdata(b);
+    for (uint32_t j = 0; j < IPERBLK && i + j < sb.inum; ++j) {
+      if (di[j].type != TYPE_NONE) imap.map[(i + j) / 32] |= 1u << ((i + j) % 32);
+    }
+    bput(b);
+  }
+  fmap_count(&imap);
+}
+
+static uint32_t igoal(uint32_t parent, int type) {
+  // a file goes next to its parent dir, a new dir goes to the group
+  // with most free blocks (parent's group if tie) to leave room for its children
+  if (type != TYPE_DIR) return parent;
+  uint32_t g = IGROUP(parent), best = g;
+  for (uint32_t i = 1; i < BG_NUM; ++i) {
+    uint32_t h = (g + i) % BG_NUM;
+    if (bmap.gfree[h] > bmap.gfree[best]) best = h;
+  }
+  return GROUP_INODE(best);
+}
+
+static uint32_t di_flags(int type) {
+  // flags of a new or truncated inode
+  uint32_t flags = (sb.features & FEAT_EXTENT) ? DI_EXTENT : 0;
+  if ((sb.features & FEAT_INLINE) && (type == TYPE_FILE || type == TYPE_DIR)) flags |= DI_INLINE;
+  return flags;
+}
+
+static uint32_t dialloc(int type, uint32_t parent) {
   // Lab3-2: iterate all dinode, find a empty one (type==TYPE_NONE)
   // set type, clean other infos and return its no (remember to write back)
   // if no empty one, just abort
   // note that first (0th) inode always unused, because dirent's inode 0 mark invalid
+  // parent is the inode no of the dir it will be in
+  uint32_t no = fmap_alloc(&imap, igoal(parent, type));
+  assert(no != -1);
   dinode_t dinode;
-  for (uint32_t i = 1; i < sb.inum; ++i) {
-    diread(&dinode, i);
-    TODO();
-  }
-  assert(0);
+  memset(&dinode, 0, sizeof dinode);
+  dinode.type = type;
+  dinode.flags = di_flags(type);
+  diwrite(&dinode, no);
+  return no;
 }
 
 static void difree(uint32_t no) {
   dinode_t dinode;
   memset(&dinode, 0, sizeof dinode);
   diwrite(&dinode, no);
+  fmap_free(&imap, no);
 }
 
-static uint32_t balloc() {
+static uint32_t balloc(uint32_t goal) {
   // Lab3-2: iterate bitmap, find one free block
   // set the bit, clean the blk (can call bzero) and return its no
   // if no free block, just abort
-  uint32_t byte;
-  for (int i = 0; i < BLK_NUM / 32; ++i) {
-    bread(&byte, 4, sb.bitmap, i * 4);
-    if (byte != 0xffffffff) {
-      TODO();
-    }
-  }
-  assert(0);
+  // the bitmap is cached in bmap, only the changed word is written back
+  // goal is the block no preferred, see fmap_alloc
+  uint32_t no = fmap_alloc(&bmap, goal);
+  assert(no != -1);
+  lbwrite(&bmap.map[no / 32], 4, sb.bitmap, no / 32 * 4);
+  bzero(no); // data block is not logged, who uses it as metadata logs it
+  return no;
 }
 
 static void bfree(uint32_t blkno) {
   // Lab3-2: clean the bit of blkno in bitmap
   assert(blkno >= 64); // cannot free first 64 block
-  TODO();
+  fmap_free(&bmap, blkno);
+  lbwrite(&bmap.map[blkno / 32], 4, sb.bitmap, blkno / 32 * 4);
 }
 
-#define INODE_NUM 128
-static inode_t inodes[INODE_NUM];
+// In memory inodes are hashed by no, unreferenced ones are kept in a free
+// list with their dinode, so reopening them needs no diread, the least
+// recently used one is reused for a new no.
+#define INODE_MIN 128 // static ones, enough before kalloc works
+#define INODE_MAX 4096
+#define IHASH_NUM 256
+
+static inode_t inodes[INODE_MIN];
+static inode_t *ihash[IHASH_NUM];
+static inode_t ifree; // sentinel, least recently used last
+static int ninode;
+
+static void ifree_add(inode_t *ip, int head) {
+  ip->prev = head ? &ifree : ifree.prev;
+  ip->next = ip->prev->next;
+  ip->prev->next = ip->next->prev = ip;
+}
+
+static void ifree_remove(inode_t *ip) {
+  ip->prev->next = ip->next;
+  ip->next->prev = ip->prev;
+}
+
+static void ihash_remove(inode_t *ip) {
+  inode_t **pp = &ihash[ip->no % IHASH_NUM];
+  while (*pp != ip) pp = &(*pp)->hnext;
+  *pp = ip->hnext;
+  ip->no = 0;
+}
+
+static void iadd(inode_t *ip) {
+  ip->no = ip->ref = ip->locked = ip->waiting = 0;
+  sem_init(&ip->wait, 0);
+  ifree_add(ip, 0);
+  ninode++;
+}
+
+static void init_icache_min() {
+  ifree.prev = ifree.next = &ifree;
+  for (int i = 0; i < INODE_MIN; ++i) {
+    iadd(&inodes[i]);
+  }
+}
+
+void init_icache() {
+  // grow the inode table by kalloc, no more than the inodes on disk
+  int n = MIN(sb.inum, INODE_MAX);
+  while (ninode < n) {
+    inode_t *page = kalloc();
+    for (int i = 0; i < PGSIZE / sizeof(inode_t) && ninode < n; ++i) {
+      iadd(&page[i]);
+    }
+  }
+}
 
 static inode_t *iget(uint32_t no) {
   // Lab3-2
   // if there exist one inode whose no is just no, inc its ref and return it
   // otherwise, find a empty inode slot, init it and return it
   // if no empty inode slot, just abort
-  TODO();
+  inode_t **pp = &ihash[no % IHASH_NUM], *ip;
+  for (ip = *pp; ip; ip = ip->hnext) {
+    if (ip->no == no) {
+      if (ip->ref++ == 0) ifree_remove(ip);
+      while (!ip->valid) {
+        // someone is loading it, sleep until it is done
+        ip->waiting++;
+        sem_p(&ip->wait);
+      }
+      return ip;
+    }
+  }
+  ip = ifree.prev;
+  assert(ip != &ifree);
+  ifree_remove(ip);
+  if (ip->no) ihash_remove(ip);
+  ip->no = no;
+  ip->ref = 1;
+  ip->del = 0;
+  ip->da_n = 0;
+  // hash it before diread, which may sleep, so nobody makes a second copy
+  ip->valid = 0;
+  ip->hnext = *pp;
+  *pp = ip;
+  diread(&ip->dinode, no);
+  ip->valid = 1;
+  for (; ip->waiting > 0; ip->waiting--) {
+    sem_v(&ip->wait);
+  }
+  return ip;
 }
 
 static void iupdate(inode_t *inode) {
@@ -214,6 +682,8 @@ static void iupdate(inode_t *inode) {
   diwrite(&inode->dinode, inode->no);
 }
 
+static uint32_t iwalk(inode_t *inode, uint32_t no, int alloc);
+
 
 // Copy the next path element from path into name.
 // Return a pointer to the element following the copied one.
@@ -262,6 +732,264 @@ static void idirinit(inode_t *inode, inode_t *parent) {
   iwrite(inode, sizeof dirent, &dirent, sizeof dirent);
 }
 
+// Hash index of big dir, it is a file of slots (power of 2), each slot
+// is 0 (empty), DH_DELETED, or the dirent index + 1 in the dir.
+// Slots are probed linearly from the name's hash.
+// Removed dirents of a hashed dir are chained from hfree, each free one
+// keeps the next's index + 1 in its name, new dirents take them first.
+// While hused is DH_STALE the index is being built and not used.
+#define DH_MIN     (BLK_SIZE / sizeof(dirent_t)) // index dir bigger than this
+#define DH_MIN_CAP (BLK_SIZE / sizeof(uint32_t))
+#define DH_DELETED 0xffffffff
+#define DH_STALE   0xffffffff
+#define DH_OPBLKS  (LOG_OPMAX / 2) // index blocks an op of dhash_build writes
+
+static int dhash_ready(inode_t *dir) {
+  return dir->dinode.hidx && dir->dinode.hused != DH_STALE;
+}
+
+static int dhash_due(inode_t *dir) {
+  // whether dir's index should be (re)built
+  if (dir->dinode.hidx) return dir->dinode.hused == DH_STALE;
+  return (sb.features & FEAT_DIRHASH) && dir->dinode.size / sizeof(dirent_t) > DH_MIN;
+}
+
+static void dlock(inode_t *dir) {
+  // creates and removes in a dir are one at a time, they may sleep on disk
+  // in the middle, and a hash index built meanwhile would miss a new dirent
+  // lookups go on without it
+  while (dir->locked) {
+    dir->waiting++;
+    sem_p(&dir->wait);
+  }
+  dir->locked = 1;
+}
+
+static void dunlock(inode_t *dir) {
+  dir->locked = 0;
+  for (; dir->waiting > 0; dir->waiting--) {
+    sem_v(&dir->wait);
+  }
+}
+
+static uint32_t dhash(const char *name) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *name; ++name) {
+    h = (h ^ (uint8_t)*name) * 16777619u;
+  }
+  return h;
+}
+
+static uint32_t dhash_find(inode_t *dir, const char *name, uint32_t *pslot) {
+  // probe dir's index for name, return its dirent offset, or dir's size if not found
+  // if found and pslot is not NULL, store the offset of the slot to it
+  inode_t *idx = iget(dir->dinode.hidx);
+  uint32_t mask = isize(idx) / sizeof(uint32_t) - 1, off = dir->dinode.size, v;
+  dirent_t dirent;
+  for (uint32_t h = dhash(name) & mask; ; h = (h + 1) & mask) {
+    iread(idx, h * sizeof v, &v, sizeof v);
+    if (v == 0) break;
+    if (v == DH_DELETED) continue;
+    iread(dir, (v - 1) * sizeof dirent, &dirent, sizeof dirent);
+    if (dirent.inode && strcmp(dirent.name, name) == 0) {
+      off = (v - 1) * sizeof dirent;
+      if (pslot) *pslot = h * sizeof v;
+      break;
+    }
+  }
+  iclose(idx);
+  return off;
+}
+
+static int dhash_insert(inode_t *idx, const char *name, uint32_t off) {
+  // put dirent at off into idx, name should not be in it
+  // return 1 if it takes an empty slot, 0 if a deleted one
+  uint32_t mask = isize(idx) / sizeof(uint32_t) - 1, h, v;
+  for (h = dhash(name) & mask; ; h = (h + 1) & mask) {
+    iread(idx, h * sizeof v, &v, sizeof v);
+    if (v == 0 || v == DH_DELETED) break;
+  }
+  int empty = v == 0;
+  v = off / sizeof(dirent_t) + 1;
+  iwrite(idx, h * sizeof v, &v, sizeof v);
+  return empty;
+}
+
+static void dhash_build(inode_t *dir) {
+  // (re)build dir's index from its dirents, big enough to keep it under half full
+  // a big index is more blocks than an op may log, so it is built by several
+  // ops of DH_OPBLKS blocks, it is stale (dir is looked up linearly) until the
+  // last one, after a crash in between the next create builds it again
+  // called out of any op, with dir locked
+  dirent_t dirent;
+  uint32_t live = 0, cap = DH_MIN_CAP, used = 0, n = 0;
+  for (uint32_t i = 0; i < dir->dinode.size; i += sizeof dirent) {
+    iread(dir, i, &dirent, sizeof dirent);
+    if (dirent.inode) live++;
+  }
+  while (cap < live * 2) cap *= 2;
+  log_begin();
+  inode_t *idx = iget(dir->dinode.hidx ? dir->dinode.hidx : dialloc(TYPE_FILE, dir->no));
+  dir->dinode.hidx = idx->no;
+  dir->dinode.hused = DH_STALE;
+  iupdate(dir);
+  log_end();
+  itrunc(idx);
+  log_begin();
+  // index is walked by blocks, never inline
+  idx->dinode.flags = (idx->dinode.flags & ~DI_INLINE) | DI_INDEX;
+  // new blocks are zeroed by balloc, so all slots are empty
+  for (uint32_t i = 0; i < cap * sizeof(uint32_t) / BLK_SIZE; ++i) {
+    if (i > 0 && i % DH_OPBLKS == 0) {
+      log_end();
+      log_begin();
+    }
+    lbzero(iwalk(idx, i, 1));
+  }
+  idx->dinode.size = cap * sizeof(uint32_t);
+  iupdate(idx);
+  for (uint32_t i = 0; i < dir->dinode.size; i += sizeof dirent) {
+    iread(dir, i, &dirent, sizeof dirent);
+    if (dirent.inode == 0) continue;
+    if (++n % DH_OPBLKS == 0) {
+      log_end();
+      log_begin();
+    }
+    used += dhash_insert(idx, dirent.name, i);
+  }
+  dir->dinode.hused = used;
+  iupdate(dir);
+  log_end();
+  iclose(idx);
+}
+
+static void dhash_add(inode_t *dir, const char *name, uint32_t off) {
+  // dirent at off is just added, index it
+  // an index 3/4 full is marked stale, to be rebuilt after the op, see dhash_due
+  if (!dhash_ready(dir)) return;
+  inode_t *idx = iget(dir->dinode.hidx);
+  if ((dir->dinode.hused + 1) * 4 > isize(idx) / sizeof(uint32_t) * 3) {
+    dir->dinode.hused = DH_STALE;
+  } else {
+    dir->dinode.hused += dhash_insert(idx, name, off);
+  }
+  iupdate(dir);
+  iclose(idx);
+}
+
+static uint32_t dhash_alloc(inode_t *dir) {
+  // return the offset for a new dirent of hashed dir, a free one or its end
+  dirent_t dirent;
+  uint32_t off = dir->dinode.size;
+  if (dir->dinode.hfree) {
+    off = (dir->dinode.hfree - 1) * sizeof dirent;
+    iread(dir, off, &dirent, sizeof dirent);
+    memcpy(&dir->dinode.hfree, dirent.name, sizeof(uint32_t));
+    iupdate(dir);
+  }
+  return off;
+}
+
+static void dhash_del(inode_t *dir, const char *name, uint32_t off) {
+  // name at off is going to be removed from dir, mark its slot deleted
+  // and put its dirent to the free chain
+  uint32_t slot, v = DH_DELETED;
+  dirent_t dirent = {0};
+  if (!dir->dinode.hidx) return;
+  if (dhash_ready(dir) && dhash_find(dir, name, &slot) != dir->dinode.size) {
+    inode_t *idx = iget(dir->dinode.hidx);
+    iwrite(idx, slot, &v, sizeof v);
+    iclose(idx);
+  }
+  memcpy(dirent.name, &dir->dinode.hfree, sizeof(uint32_t));
+  iwrite(dir, off, &dirent, sizeof dirent);
+  dir->dinode.hfree = off / sizeof dirent + 1;
+  iupdate(dir);
+}
+
+// Dentry cache, maps (parent dir's inode no, name) to the file's inode no
+// and its dirent offset, ino 0 means no such file (negative entry).
+// Entries are hashed and replaced by LRU, like the block cache.
+#define DCACHE_NUM 256
+#define DC_HASH_NUM 64
+
+typedef struct dentry {
+  uint32_t parent; // 0 if unused
+  uint32_t ino;
+  uint32_t off;
+  char name[MAX_NAME + 1];
+  struct dentry *hnext, *prev, *next;
+} dentry_t;
+
+static dentry_t dcache[DCACHE_NUM];
+static dentry_t *dc_hash[DC_HASH_NUM];
+static dentry_t dc_lru; // sentinel, most recently used first
+
+static void dc_touch(dentry_t *d, int head) {
+  // move d to the head (or tail) of lru
+  d->prev->next = d->next;
+  d->next->prev = d->prev;
+  d->prev = head ? &dc_lru : dc_lru.prev;
+  d->next = d->prev->next;
+  d->prev->next = d->next->prev = d;
+}
+
+static void init_dcache() {
+  dc_lru.prev = dc_lru.next = &dc_lru;
+  for (int i = 0; i < DCACHE_NUM; ++i) {
+    dcache[i].prev = dcache[i].next = &dcache[i];
+    dc_touch(&dcache[i], 0);
+  }
+}
+
+static dentry_t **dc_bucket(uint32_t parent, const char *name) {
+  return &dc_hash[(dhash(name) ^ parent * 2654435761u) % DC_HASH_NUM];
+}
+
+static dentry_t *dc_find(uint32_t parent, const char *name) {
+  for (dentry_t *d = *dc_bucket(parent, name); d; d = d->hnext) {
+    if (d->parent == parent && strcmp(d->name, name) == 0) {
+      dc_touch(d, 1);
+      return d;
+    }
+  }
+  return NULL;
+}
+
+static void dc_drop(dentry_t *d) {
+  // unhash d and make it the next victim
+  dentry_t **pp = dc_bucket(d->parent, d->name);
+  while (*pp != d) pp = &(*pp)->hnext;
+  *pp = d->hnext;
+  d->parent = 0;
+  dc_touch(d, 0);
+}
+
+static void dc_set(uint32_t parent, const char *name, uint32_t ino, uint32_t off) {
+  // cache name in parent as ino at off, reuse the least recently used entry if new
+  dentry_t *d = dc_find(parent, name);
+  if (d == NULL) {
+    d = dc_lru.prev;
+    if (d->parent) dc_drop(d);
+    d->parent = parent;
+    strcpy(d->name, name);
+    dentry_t **pp = dc_bucket(parent, name);
+    d->hnext = *pp;
+    *pp = d;
+    dc_touch(d, 1);
+  }
+  d->ino = ino;
+  d->off = off;
+}
+
+static void dc_purge(uint32_t parent) {
+  // dir parent is freed, its no may be reused, drop all entries in it
+  for (int i = 0; i < DCACHE_NUM; ++i) {
+    if (dcache[i].parent == parent) dc_drop(&dcache[i]);
+  }
+}
+
 static inode_t *ilookup(inode_t *parent, const char *name, uint32_t *off, int type) {
   // Lab3-2: iterate the parent dir, find a file whose name is name
   // if off is not NULL, store the offset of the dirent_t to it
@@ -269,23 +997,60 @@ static inode_t *ilookup(inode_t *parent, const char *name, uint32_t *off, int ty
   // if no such file and type != TYPE_NONE, create the file with the type
   assert(parent->dinode.type == TYPE_DIR); // parent must be a dir
   dirent_t dirent;
-  uint32_t size = parent->dinode.size, empty = size;
-  for (uint32_t i = 0; i < size; i += sizeof dirent) {
-    // directory is a file containing a sequence of dirent structures
-    iread(parent, i, &dirent, sizeof dirent);
-    if (dirent.inode == 0) {
-      // a invalid dirent, record the offset (used in create file), then skip
-      if (empty == size) empty = i;
-      continue;
+  uint32_t size = parent->dinode.size, empty = size, found = size;
+  dentry_t *d = dc_find(parent->no, name);
+  if (d && d->ino) {
+    if (off) *off = d->off;
+    return iget(d->ino);
+  }
+  if (d && type == TYPE_NONE) return NULL;
+  if (dhash_ready(parent)) {
+    // hashed dir, probe the index instead of iterating
+    // a new dirent takes a free one by dhash_alloc, not the first hole
+    found = dhash_find(parent, name, NULL);
+    if (found != size) iread(parent, found, &dirent, sizeof dirent);
+  } else {
+    for (uint32_t i = 0; i < size; i += sizeof dirent) {
+      // directory is a file containing a sequence of dirent structures
+      iread(parent, i, &dirent, sizeof dirent);
+      if (dirent.inode == 0) {
+        // a invalid dirent, record the offset (used in create file), then skip
+        if (empty == size) empty = i;
+        continue;
+      }
+      // a valid dirent, compare the name
+      if (strcmp(dirent.name, name) == 0) {
+        found = i;
+        break;
+      }
     }
-    // a valid dirent, compare the name
-    TODO();
+  }
+  if (found != size) {
+    dc_set(parent->no, name, dirent.inode, found);
+    if (off) *off = found;
+    return iget(dirent.inode);
   }
   // not found
-  if (type == TYPE_NONE) return NULL;
+  if (type == TYPE_NONE) {
+    dc_set(parent->no, name, 0, 0);
+    return NULL;
+  }
   // need to create the file, first alloc inode, then init dirent, write it to parent
   // if you create a dir, remember to init it's . and ..
-  TODO();
+  log_begin();
+  dirent.inode = dialloc(type, parent->no);
+  strcpy(dirent.name, name);
+  if (parent->dinode.hidx) empty = dhash_alloc(parent);
+  iwrite(parent, empty, &dirent, sizeof dirent);
+  dhash_add(parent, name, empty);
+  dc_set(parent->no, name, dirent.inode, empty);
+  inode_t *ip = iget(dirent.inode);
+  if (type == TYPE_DIR) idirinit(ip, parent);
+  log_end();
+  // parent is locked by iopen, build its index now if it is due, out of the op
+  if (proc_curr()->logop == 0 && dhash_due(parent)) dhash_build(parent);
+  if (off) *off = empty;
+  return ip;
 }
 
 static inode_t *iopen_parent(const char *path, char *name) {
@@ -336,27 +1101,556 @@ inode_t *iopen(const char *path, int type) {
   }
   // path do have parent, use iopen_parent and ilookup to open it
   // remember to close the parent inode after you ilookup it
-  TODO();
+  inode_t *parent = iopen_parent(path, name);
+  if (parent == NULL) return NULL;
+  if (type != TYPE_NONE) dlock(parent); // it may create
+  inode_t *ip = ilookup(parent, name, NULL, type);
+  if (type != TYPE_NONE) dunlock(parent);
+  iclose(parent);
+  return ip;
+}
+
+// a node of extent tree, pinned if it is a block
+typedef struct {
+  buf_t *b; // NULL for the root in dinode
+  ext_hdr_t *hdr;
+  extent_t *e;
+} ext_path_t;
+
+static void ext_get(inode_t *inode, ext_path_t *p, uint32_t blk) {
+  // blk 0 means the root
+  if (blk == 0) {
+    p->b = NULL;
+    p->hdr = &inode->dinode.ext.hdr;
+    p->e = inode->dinode.ext.e;
+  } else {
+    p->b = bget(blk);
+    ext_node_t *node = bdata(p->b);
+    p->hdr = &node->hdr;
+    p->e = node->e;
+  }
+}
+
+static void ext_put(inode_t *inode, ext_path_t *p, int dirty) {
+  if (p->b) {
+    if (dirty) lbdirty(p->b);
+    bput(p->b);
+  } else if (dirty) {
+    iupdate(inode);
+  }
+}
+
+static int ext_search(ext_path_t *p, uint32_t lblk) {
+  // index of the last entry whose lblk <= lblk, -1 if none
+  int lo = 0, hi = p->hdr->n - 1, i = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (p->e[mid].lblk <= lblk) {
+      i = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return i;
+}
+
+static uint32_t ext_lookup(inode_t *inode, uint32_t lblk) {
+  // return the disk block of file block lblk, 0 if not mapped
+  ext_path_t p;
+  ext_get(inode, &p, 0);
+  while (1) {
+    int i = ext_search(&p, lblk), leaf = (p.hdr->depth == 0 || i < 0);
+    uint32_t ret = 0;
+    if (i >= 0 && p.hdr->depth > 0) {
+      ret = p.e[i].start;
+    } else if (i >= 0 && lblk < p.e[i].lblk + p.e[i].len) {
+      ret = p.e[i].start + (lblk - p.e[i].lblk);
+    }
+    ext_put(inode, &p, 0);
+    if (leaf) return ret;
+    ext_get(inode, &p, ret);
+  }
+}
+
+static void ext_grow(inode_t *inode, extent_t entry) {
+  // root is full: move it to a new node with entry, root points to it
+  ext_root_t *root = &inode->dinode.ext;
+  ext_path_t np;
+  uint32_t blk = balloc(entry.start + 1);
+  ext_get(inode, &np, blk);
+  np.hdr->depth = root->hdr.depth;
+  np.hdr->n = root->hdr.n;
+  memcpy(np.e, root->e, sizeof root->e);
+  np.e[np.hdr->n++] = entry;
+  ext_put(inode, &np, 1);
+  assert(root->hdr.depth < EXT_MAX_DEPTH);
+  root->hdr.depth++;
+  root->hdr.n = 1;
+  root->e[0] = (extent_t){root->e[0].lblk, blk, 0};
+  iupdate(inode);
 }
 
-static uint32_t iwalk(inode_t *inode, uint32_t no) {
-  // return the blkno of the file's data's no th block, if no, alloc it
+static void ext_append(inode_t *inode, uint32_t lblk, uint32_t pblk) {
+  // map file block lblk to disk block pblk, lblk must be after all mapped ones
+  // so only the rightmost path of the tree changes
+  ext_path_t path[EXT_MAX_DEPTH + 1];
+  int lv = 0, mod = -1;
+  ext_get(inode, &path[0], 0);
+  while (path[lv].hdr->depth > 0) {
+    ext_path_t *p = &path[lv];
+    ext_get(inode, &path[lv + 1], p->e[p->hdr->n - 1].start);
+    lv++;
+  }
+  int leaf = lv;
+  ext_path_t *p = &path[leaf];
+  extent_t *last = p->hdr->n ? &p->e[p->hdr->n - 1] : NULL;
+  assert(last == NULL || lblk >= last->lblk + last->len);
+  if (last && last->lblk + last->len == lblk && last->start + last->len == pblk) {
+    // continuous, just extend the last extent
+    last->len++;
+    mod = leaf;
+  } else {
+    extent_t entry = {lblk, pblk, 1};
+    for (; lv >= 0; --lv) {
+      p = &path[lv];
+      int cap = lv == 0 ? EXT_ROOT_NUM : EXT_NODE_NUM;
+      if (p->hdr->n < cap) {
+        p->e[p->hdr->n++] = entry;
+        mod = lv;
+        break;
+      }
+      if (lv == 0) {
+        ext_grow(inode, entry);
+        break;
+      }
+      // node is full, start a new node at this level holding only entry
+      ext_path_t np;
+      uint32_t blk = balloc(pblk + 1);
+      ext_get(inode, &np, blk);
+      np.hdr->depth = p->hdr->depth;
+      np.hdr->n = 1;
+      np.e[0] = entry;
+      ext_put(inode, &np, 1);
+      entry = (extent_t){lblk, blk, 0};
+    }
+  }
+  for (lv = leaf; lv >= 0; --lv) {
+    ext_put(inode, &path[lv], lv == mod);
+  }
+}
+
+static void ext_free(ext_hdr_t *hdr, extent_t *e) {
+  // free all blocks under a node, except itself
+  for (int i = 0; i < hdr->n; ++i) {
+    if (hdr->depth == 0) {
+      for (uint32_t j = 0; j < e[i].len; ++j) {
+        bfree(e[i].start + j);
+      }
+    } else {
+      buf_t *b = bget(e[i].start);
+      ext_node_t *node = bdata(b);
+      ext_free(&node->hdr, node->e);
+      bput(b);
+      bfree(e[i].start);
+    }
+  }
+}
+
+static void ind_free(uint32_t blkno, int level) {
+  // free the indirect block blkno and all blocks it points to,
+  // level is 1 if it points to data blocks
+  buf_t *b = bget(blkno);
+  uint32_t *ind = bdata(b);
+  for (int i = 0; i < NINDIRECT; ++i) {
+    if (ind[i] == 0) continue;
+    if (level > 1) ind_free(ind[i], level - 1);
+    else bfree(ind[i]);
+  }
+  bput(b);
+  bfree(blkno);
+}
+
+static uint32_t bgoal(inode_t *inode, uint32_t no) {
+  // where to alloc the file's no th block: right after its no-1 th block,
+  // or the start of the inode's group for the first one
+  uint32_t prev = no > 0 ? iwalk(inode, no - 1, 0) : 0;
+  return prev ? prev + 1 : IGROUP(inode->no) * BG_BLKS;
+}
+
+static uint32_t iwalk(inode_t *inode, uint32_t no, int alloc) {
+  // return the blkno of the file's data's no th block
+  // if no such block, alloc it if alloc, otherwise return 0
+  // new blocks (indirect ones included) are placed by bgoal
+  uint32_t *addrs = inode->dinode.addrs, blkno, lblk = no;
+  if (inode->dinode.flags & DI_EXTENT) {
+    blkno = ext_lookup(inode, no);
+    if (blkno == 0 && alloc) {
+      blkno = balloc(bgoal(inode, no));
+      ext_append(inode, no, blkno);
+    }
+    return blkno;
+  }
   if (no < NDIRECT) {
     // direct address
-    TODO();
+    if (addrs[no] == 0 && alloc) {
+      addrs[no] = balloc(bgoal(inode, no));
+      iupdate(inode);
+    }
+    return addrs[no];
   }
+  // indirect address, find which level's tree no falls in,
+  // span is the block num covered by that tree
   no -= NDIRECT;
-  if (no < NINDIRECT) {
-    // indirect address
-    TODO();
+  int level = 1;
+  uint32_t span = NINDIRECT;
+  while (no >= span) {
+    assert(level < NLEVEL); // file too big, not need to handle this case
+    no -= span;
+    span *= NINDIRECT;
+    level++;
+  }
+  uint32_t *slot = &addrs[NDIRECT + level - 1];
+  if (*slot == 0) {
+    if (!alloc) return 0;
+    *slot = balloc(bgoal(inode, lblk));
+    iupdate(inode);
+  }
+  // walk down the tree, indirect blocks stay in block cache,
+  // so each level costs at most one miss
+  blkno = *slot;
+  for (; level > 0; level--) {
+    span /= NINDIRECT;
+    buf_t *b = bget(blkno);
+    uint32_t *ind = bdata(b);
+    if (ind[no / span] == 0 && alloc) {
+      ind[no / span] = balloc(bgoal(inode, lblk));
+      lbdirty(b);
+    }
+    blkno = ind[no / span];
+    bput(b);
+    if (blkno == 0) return 0;
+    no %= span;
+  }
+  return blkno;
+}
+
+// Delayed allocation: blocks appended to a regular file are kept in a
+// pool of memory buffers without disk blocks, they must be a run at the
+// file's tail. The run is allocated together when flushed, so it lands
+// contiguous and small appends to the same block do not touch the disk.
+// A run is flushed when it is DA_MAX long, the pool is used up,
+// the file is closed, or by isync.
+#define DA_NUM 16
+#define DA_MAX 8
+
+typedef struct {
+  inode_t *owner; // NULL if free
+  uint32_t lblk;
+  uint8_t data[BLK_SIZE];
+} dabuf_t;
+
+static dabuf_t dabufs[DA_NUM];
+
+static dabuf_t *ida_find(inode_t *inode, uint32_t lblk) {
+  if (lblk - inode->da_lblk >= inode->da_n) return NULL;
+  for (int i = 0; i < DA_NUM; ++i) {
+    if (dabufs[i].owner == inode && dabufs[i].lblk == lblk) return &dabufs[i];
+  }
+  panic("delayed block lost");
+}
+
+static void ida_flush(inode_t *inode) {
+  // alloc disk blocks for the delayed run and move its data to block cache
+  // the blocks are alloced one after another, so they are contiguous if possible
+  for (uint32_t i = 0; i < inode->da_n; ++i) {
+    dabuf_t *d = ida_find(inode, inode->da_lblk + i);
+    bwrite(d->data, BLK_SIZE, iwalk(inode, d->lblk, 1), 0);
+    d->owner = NULL;
+  }
+  inode->da_n = 0;
+}
+
+static void ida_drop(inode_t *inode) {
+  // file is truncated, forget the delayed run
+  for (int i = 0; i < DA_NUM; ++i) {
+    if (dabufs[i].owner == inode) dabufs[i].owner = NULL;
+  }
+  inode->da_n = 0;
+}
+
+static uint8_t *ida_get(inode_t *inode, uint32_t lblk) {
+  // return the memory of the file's lblk th block if it is delayed, otherwise NULL
+  // a block not alloced yet becomes delayed if it extends the run
+  dabuf_t *d = ida_find(inode, lblk);
+  if (d) return d->data;
+  if (inode->dinode.type != TYPE_FILE || iwalk(inode, lblk, 0) != 0) return NULL;
+  if (inode->da_n > 0 && lblk != inode->da_lblk + inode->da_n) return NULL;
+  if (inode->da_n == DA_MAX) ida_flush(inode);
+  for (d = dabufs; d->owner; ) {
+    if (++d == &dabufs[DA_NUM]) {
+      // pool is used up, flush the first one's owner
+      ida_flush(dabufs[0].owner);
+      d = dabufs;
+    }
   }
-  assert(0); // file too big, not need to handle this case
+  if (inode->da_n == 0) inode->da_lblk = lblk;
+  inode->da_n++;
+  d->owner = inode;
+  d->lblk = lblk;
+  memset(d->data, 0, BLK_SIZE);
+  return d->data;
+}
+
+// Page cache of file data. A page holds bytes [pgno*PGSIZE, (pgno+1)*PGSIZE)
+// of regular file ino, it is filled through the block layer and kept up to
+// date by iwrite, truncation drops it. iread (so exec too) serves files from
+// it, pget pins a page for others, e.g. to map it. The least recently used
+// unpinned page is replaced. No page cache before init_pcache.
+#define PCACHE_MAX 4096
+#define PHASH_NUM  256
+
+struct fpage {
+  uint32_t ino, pgno; // ino 0 if unused
+  int ref;            // pinned by pget, cannot be replaced while ref>0
+  int valid;          // filled
+  int waiting;        // procs waiting for it to be filled
+  sem_t wait;
+  struct fpage *hnext;       // hash chain
+  struct fpage *dnext;       // hash chain by data, for plookup
+  struct fpage *prev, *next; // LRU list, plru.next is the most recently used
+  uint8_t *data;
+};
+
+static fpage_t fpages[PCACHE_MAX];
+static fpage_t *phash[PHASH_NUM], *pdhash[PHASH_NUM];
+static fpage_t plru;
+static int nfpage;
+
+#define PHASH(ino, pgno) (((ino) * 31 + (pgno)) % PHASH_NUM)
+#define PDHASH(data)     (((uint32_t)(data) / PGSIZE) % PHASH_NUM)
+
+static void plru_remove(fpage_t *p) {
+  p->prev->next = p->next;
+  p->next->prev = p->prev;
+}
+
+static void plru_push(fpage_t *p) {
+  p->prev = &plru;
+  p->next = plru.next;
+  plru.next->prev = p;
+  plru.next = p;
+}
+
+void init_pcache() {
+  // take 1/16 of the kernel heap (free memory at boot), as block cache does
+  int n = MIN((PHY_MEM - KER_MEM) / PGSIZE / 16, PCACHE_MAX);
+  static_assert(BLK_SIZE == PGSIZE, "one block per page");
+  plru.prev = plru.next = &plru;
+  for (; nfpage < n; ++nfpage) {
+    fpage_t *p = &fpages[nfpage];
+    p->data = kalloc();
+    sem_init(&p->wait, 0);
+    p->dnext = pdhash[PDHASH(p->data)];
+    pdhash[PDHASH(p->data)] = p;
+    plru.prev->next = p; // new page is the first to be used
+    p->prev = plru.prev;
+    p->next = &plru;
+    plru.prev = p;
+  }
+}
+
+static int pcached(inode_t *inode) {
+  return nfpage > 0 && inode->dinode.type == TYPE_FILE &&
+         !(inode->dinode.flags & (DI_INLINE | DI_INDEX));
+}
+
+static fpage_t *pfind(uint32_t ino, uint32_t pgno) {
+  for (fpage_t *p = phash[PHASH(ino, pgno)]; p; p = p->hnext) {
+    if (p->ino == ino && p->pgno == pgno) return p;
+  }
+  return NULL;
+}
+
+static void phash_remove(fpage_t *p) {
+  fpage_t **pp = &phash[PHASH(p->ino, p->pgno)];
+  while (*pp != p) pp = &(*pp)->hnext;
+  *pp = p->hnext;
+  p->ino = 0;
+}
+
+fpage_t *pget(inode_t *inode, uint32_t pgno) {
+  // pin the inode's page pgno (fill it if need), call pput after use
+  // NULL if the inode is not cached by pages or all pages are pinned
+  if (!pcached(inode)) return NULL;
+  fpage_t *p = pfind(inode->no, pgno);
+  if (p) {
+    p->ref++;
+    while (!p->valid) {
+      // someone is filling it, sleep until it is done
+      p->waiting++;
+      sem_p(&p->wait);
+    }
+    return p;
+  }
+  for (p = plru.prev; p != &plru && p->ref > 0; p = p->prev);
+  if (p == &plru) return NULL;
+  if (p->ino) phash_remove(p);
+  p->ino = inode->no;
+  p->pgno = pgno;
+  p->ref = 1;
+  p->valid = 0;
+  p->hnext = phash[PHASH(p->ino, pgno)];
+  phash[PHASH(p->ino, pgno)] = p;
+  // it is in hash before filling, so iwrite meanwhile goes to it too
+  dabuf_t *d = ida_find(inode, pgno);
+  uint32_t no;
+  if (d) {
+    memcpy(p->data, d->data, PGSIZE);
+  } else if ((no = iwalk(inode, pgno, 0)) != 0) {
+    bread(p->data, PGSIZE, no, 0);
+  } else {
+    memset(p->data, 0, PGSIZE);
+  }
+  p->valid = 1;
+  for (; p->waiting > 0; p->waiting--) {
+    sem_v(&p->wait);
+  }
+  return p;
+}
+
+void *pdata(fpage_t *page) {
+  return page->data;
+}
+
+void pput(fpage_t *page) {
+  assert(page->ref > 0);
+  if (--page->ref == 0) {
+    plru_remove(page);
+    plru_push(page);
+  }
+}
+
+fpage_t *plookup(void *data) {
+  // the page whose memory is data, e.g. it is mapped by mmap, NULL if none
+  for (fpage_t *p = pdhash[PDHASH(data)]; p; p = p->dnext) {
+    if (p->data == data) return p;
+  }
+  return NULL;
+}
+
+void pflush(inode_t *inode, fpage_t *page) {
+  // page of inode is modified in place (by a shared mapping), write it to
+  // the file's blocks, but not beyond size and not if it is truncated
+  uint32_t off = page->pgno * PGSIZE;
+  if (page->ino != inode->no || off >= inode->dinode.size) return;
+  uint32_t n = MIN(PGSIZE, inode->dinode.size - off);
+  dabuf_t *d = ida_find(inode, page->pgno);
+  if (d) {
+    memcpy(d->data, page->data, n);
+  } else {
+    bwrite(page->data, n, iwalk(inode, page->pgno, 1), 0);
+  }
+}
+
+static void pupdate(inode_t *inode, uint32_t off, const void *buf, uint32_t len) {
+  // write through [off, off+len) in one page to the cached page
+  if (!pcached(inode)) return;
+  fpage_t *p = pfind(inode->no, off / PGSIZE);
+  if (p) memcpy(&p->data[off % PGSIZE], buf, len);
+}
+
+static void pdrop(inode_t *inode) {
+  // inode is truncated, forget its pages, pinned ones go when they are put
+  if (!pcached(inode)) return;
+  for (uint32_t i = 0; i < (inode->dinode.size + PGSIZE - 1) / PGSIZE; ++i) {
+    fpage_t *p = pfind(inode->no, i);
+    if (p) phash_remove(p);
+  }
+}
+
+void isync() {
+  // flush all delayed runs and commit the log, call me before bsync
+  for (int i = 0; i < DA_NUM; ++i) {
+    if (dabufs[i].owner) ida_flush(dabufs[i].owner);
+  }
+  log_sync();
+}
+
+void isync_tick() {
+  // called by timer, cannot sleep here, only mark an old batch due,
+  // the next log_begin or isync_due commits it
+  if (journal.hdr.n > 0 && get_tick() - journal.tick >= COMMIT_TICKS) {
+    journal.due = 1;
+  }
+}
+
+void isync_due() {
+  // called in process context (syscall return), commit a batch the timer
+  // marked due, so an idle one is still on disk in about COMMIT_TICKS
+  if (journal.due) log_sync();
 }
 
 int iread(inode_t *inode, uint32_t off, void *buf, uint32_t len) {
   // Lab3-2: read the inode's data [off, MIN(off+len, size)) to buf
   // use iwalk to get the blkno and read blk by blk
-  TODO();
+  uint32_t size = inode->dinode.size;
+  if (off >= size) return 0;
+  uint32_t end = MIN(off + len, size), n, no;
+  if (inode->dinode.flags & DI_INLINE) {
+    memcpy(buf, &inode->dinode.data[off], end - off);
+    return end - off;
+  }
+  for (uint32_t cur = off; cur < end; cur += n, buf += n) {
+    n = MIN(BLK_SIZE - cur % BLK_SIZE, end - cur);
+    dabuf_t *d = ida_find(inode, cur / BLK_SIZE);
+    fpage_t *p;
+    if (d) {
+      memcpy(buf, &d->data[cur % BLK_SIZE], n);
+    } else if ((p = pget(inode, cur / BLK_SIZE)) != NULL) {
+      memcpy(buf, &p->data[cur % BLK_SIZE], n);
+      pput(p);
+    } else if ((no = iwalk(inode, cur / BLK_SIZE, 0)) != 0) {
+      bread(buf, n, no, cur % BLK_SIZE);
+    } else {
+      memset(buf, 0, n); // no disk block, reads as zeros
+    }
+  }
+  return end - off;
+}
+
+void ireadahead(inode_t *inode, uint32_t blk, uint32_t n) {
+  // prefetch the inode's data blocks [blk, blk+n) into block cache
+  // without waiting for them, blocks beyond size or in page cache are ignored
+  if (inode->dinode.flags & DI_INLINE) return;
+  uint32_t nblk = (inode->dinode.size + BLK_SIZE - 1) / BLK_SIZE;
+  for (uint32_t i = blk; i < blk + n && i < nblk; ++i) {
+    if (pcached(inode) && pfind(inode->no, i)) continue;
+    uint32_t no = iwalk(inode, i, 0);
+    if (no) bprefetch(no);
+  }
+}
+
+static void ispill(inode_t *inode) {
+  // inline data is growing out of dinode, move it to data blocks
+  uint8_t data[INLINE_MAX];
+  uint32_t size = inode->dinode.size;
+  memcpy(data, inode->dinode.data, size);
+  memset(inode->dinode.data, 0, INLINE_MAX);
+  inode->dinode.flags &= ~DI_INLINE;
+  inode->dinode.size = 0;
+  if (size) iwrite(inode, 0, data, size);
+}
+
+int ipageable(inode_t *inode) {
+  // make inode's data served by page cache (for a shared mmap), inline
+  // data is moved to blocks, return -1 if it cannot be
+  if (nfpage == 0 || inode->dinode.type != TYPE_FILE || (inode->dinode.flags & DI_INDEX)) return -1;
+  if (inode->dinode.flags & DI_INLINE) {
+    ispill(inode);
+    if (inode->dinode.size == 0) iupdate(inode); // iwrite did not
+  }
+  return 0;
 }
 
 int iwrite(inode_t *inode, uint32_t off, const void *buf, uint32_t len) {
@@ -364,13 +1658,69 @@ int iwrite(inode_t *inode, uint32_t off, const void *buf, uint32_t len) {
   // if off>size, return -1 (can not cross size before write)
   // if off+len>size, update it as new size (but can cross size after write)
   // use iwalk to get the blkno and read blk by blk
-  TODO();
+  uint32_t size = inode->dinode.size;
+  if (off > size) return -1;
+  uint32_t end = off + len, n;
+  if (inode->dinode.flags & DI_INLINE) {
+    if (end <= INLINE_MAX) {
+      memcpy(&inode->dinode.data[off], buf, len);
+      inode->dinode.size = MAX(size, end);
+      iupdate(inode);
+      return len;
+    }
+    ispill(inode);
+  }
+  for (uint32_t cur = off; cur < end; cur += n, buf += n) {
+    n = MIN(BLK_SIZE - cur % BLK_SIZE, end - cur);
+    uint8_t *data = ida_get(inode, cur / BLK_SIZE);
+    if (data) {
+      memcpy(&data[cur % BLK_SIZE], buf, n);
+    } else if (inode->dinode.type == TYPE_FILE && !(inode->dinode.flags & DI_INDEX)) {
+      bwrite(buf, n, iwalk(inode, cur / BLK_SIZE, 1), cur % BLK_SIZE);
+    } else {
+      lbwrite(buf, n, iwalk(inode, cur / BLK_SIZE, 1), cur % BLK_SIZE);
+    }
+    pupdate(inode, cur, buf, n);
+  }
+  if (end > size) {
+    inode->dinode.size = end;
+    iupdate(inode);
+  }
+  return len;
 }
 
 void itrunc(inode_t *inode) {
   // Lab3-2: free all data block used by inode (direct and indirect)
   // mark all address of inode 0 and mark its size 0
-  TODO();
+  uint32_t *addrs = inode->dinode.addrs;
+  log_begin();
+  pdrop(inode);
+  ida_drop(inode);
+  if (inode->dinode.hidx) {
+    // dir's hash index goes with its data
+    inode_t *idx = iget(inode->dinode.hidx);
+    idx->del = 1;
+    iclose(idx);
+    inode->dinode.hidx = inode->dinode.hused = inode->dinode.hfree = 0;
+  }
+  if (inode->dinode.flags & DI_INLINE) {
+    // no block to free
+  } else if (inode->dinode.flags & DI_EXTENT) {
+    ext_free(&inode->dinode.ext.hdr, inode->dinode.ext.e);
+  } else {
+    for (int i = 0; i < NDIRECT; ++i) {
+      if (addrs[i]) bfree(addrs[i]);
+    }
+    for (int i = 0; i < NLEVEL; ++i) {
+      if (addrs[NDIRECT + i]) ind_free(addrs[NDIRECT + i], i + 1);
+    }
+  }
+  // it is empty again, so it may be inline again
+  memset(inode->dinode.data, 0, INLINE_MAX);
+  inode->dinode.flags = di_flags(inode->dinode.type);
+  inode->dinode.size = 0;
+  iupdate(inode);
+  log_end();
 }
 
 inode_t *idup(inode_t *inode) {
@@ -382,10 +1732,18 @@ inode_t *idup(inode_t *inode) {
 void iclose(inode_t *inode) {
   assert(inode);
   if (inode->ref == 1 && inode->del) {
+    if (inode->dinode.type == TYPE_DIR) dc_purge(inode->no);
+    log_begin();
     itrunc(inode);
     difree(inode->no);
+    log_end();
+    ihash_remove(inode);
+  } else if (inode->ref == 1) {
+    ida_flush(inode);
   }
   inode->ref -= 1;
+  // a freed one goes to the tail to be reused first
+  if (inode->ref == 0) ifree_add(inode, inode->no != 0);
 }
 
 uint32_t isize(inode_t *inode) {
@@ -417,7 +1775,12 @@ static int idirempty(inode_t *inode) {
   // the first two dirent of dir must be . and ..
   // you just need to check whether other dirent are all invalid
   assert(inode->dinode.type == TYPE_DIR);
-  TODO();
+  dirent_t dirent;
+  for (uint32_t i = 2 * sizeof dirent; i < inode->dinode.size; i += sizeof dirent) {
+    iread(inode, i, &dirent, sizeof dirent);
+    if (dirent.inode != 0) return 0;
+  }
+  return 1;
 }
 
 int iremove(const char *path) {
@@ -428,7 +1791,33 @@ int iremove(const char *path) {
   // . and .. cannot be remove, so check name set by iopen_parent
   // remove a file just need to clean the dirent points to it and set its inode's del
   // the real remove will be done at iclose, after everyone close it
-  TODO();
+  char name[MAX_NAME + 1];
+  uint32_t off, zero = 0;
+  inode_t *parent = iopen_parent(path, name), *ip;
+  if (parent == NULL) return -1;
+  dlock(parent);
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+      (ip = ilookup(parent, name, &off, TYPE_NONE)) == NULL) {
+    dunlock(parent);
+    iclose(parent);
+    return -1;
+  }
+  if (ip->dinode.type == TYPE_DIR && !idirempty(ip)) {
+    iclose(ip);
+    dunlock(parent);
+    iclose(parent);
+    return -1;
+  }
+  log_begin();
+  dhash_del(parent, name, off);
+  iwrite(parent, off, &zero, sizeof zero);
+  log_end();
+  dc_set(parent->no, name, 0, 0);
+  ip->del = 1;
+  iclose(ip);
+  dunlock(parent);
+  iclose(parent);
+  return 0;
 }
 
 #endif
@@ -6,7 +6,35 @@
 #include "fs.h"
 #include <elf.h>
 
-uint32_t load_elf(PD *pgdir, const char *name) {
+#define ELF_RA_MAX 64 // blocks
+
+static int load_seg(PD *pgdir, vma_t **vmas, inode_t *inode, Elf32_Phdr *ph) {
+  // map the segment to vmas, its pages are faulted in on first touch,
+  // from inode's page cache for file data, zero filled for bss
+  // only the page holding both the end of file data and bss is loaded now
+  int prot = (ph->p_flags & PF_W) ? PROT_READ | PROT_WRITE : PROT_READ;
+  size_t start = PAGE_DOWN(ph->p_vaddr);
+  size_t fend = ph->p_vaddr + ph->p_filesz;
+  size_t end = PAGE_UP(ph->p_vaddr + ph->p_memsz);
+  // the file page at fend has other data after the segment, bss must not see it
+  size_t mid = ph->p_memsz > ph->p_filesz ? PAGE_DOWN(fend) : PAGE_UP(fend);
+  if (ADDR2OFF(ph->p_vaddr) != ADDR2OFF(ph->p_offset)) return -1;
+  if (mid > start && vm_mmap(vmas, start, mid - start, prot, MAP_PRIVATE | MAP_FIXED,
+      inode, PAGE_DOWN(ph->p_offset)) != start) return -1;
+  if (end > mid) {
+    if (vm_mmap(vmas, mid, end - mid, prot, MAP_PRIVATE | MAP_ANON | MAP_FIXED, NULL, 0) != mid) return -1;
+    size_t va = MAX(mid, ph->p_vaddr);
+    if (fend > va) {
+      vm_map(pgdir, mid, PGSIZE, (prot & PROT_WRITE) ? PTE_P | PTE_U | PTE_W : PTE_P | PTE_U);
+      char *page = vm_walk(pgdir, mid, 0);
+      memset(page, 0, PGSIZE);
+      iread(inode, ph->p_offset + (va - ph->p_vaddr), page + (va - mid), fend - va);
+    }
+  }
+  return 0;
+}
+
+uint32_t load_elf(PD *pgdir, vma_t **vmas, const char *name) {
   Elf32_Ehdr elf;
   Elf32_Phdr ph;
   inode_t *inode = iopen(name, TYPE_NONE);
@@ -16,17 +44,29 @@ uint32_t load_elf(PD *pgdir, const char *name) {
     iclose(inode);
     return -1;
   }
+  if (pgdir == NULL) {
+    // segments are read in small pieces below, prefetch the file first
+    // iread serves it from page cache, so exec of a recent binary does no disk io
+    // with a pgdir nothing is read here, vm_pgfault reads ahead what is touched
+    ireadahead(inode, 0, MIN((isize(inode) + BLK_SIZE - 1) / BLK_SIZE, ELF_RA_MAX));
+  }
 
   // WEEK3-virtual-memory: Restore cr3 for convenient loading
 
   for (int i = 0; i < elf.e_phnum; ++i) {
     iread(inode, elf.e_phoff + i * sizeof(ph), &ph, sizeof(ph));
     if (ph.p_type == PT_LOAD) {
-      // WEEK1: Load segment to physical memory
-      // TODO();
-
+      if (pgdir == NULL) {
+        // WEEK1: Load segment to physical memory
+        // TODO();
+        continue;
+      }
       // WEEK3-virtual-memory: Load segment to virtual memory
-      // TODO();
+      // segments are paged in on demand, nothing is read here
+      if (load_seg(pgdir, vmas, inode, &ph) != 0) {
+        iclose(inode);
+        return -1;
+      }
     }
   }
   
@@ -74,8 +114,9 @@ uint32_t load_arg(PD *pgdir, char *const argv[]) {
   // return USR_MEM - PGSIZE + ADDR2OFF(stack_top); // change to me in WEEK3-virtual-memory
 }
 
-int load_user(PD *pgdir, Context *ctx, const char *name, char *const argv[]) {
-  size_t eip = load_elf(pgdir, name);
+int load_user(PD *pgdir, vma_t **vmas, Context *ctx, const char *name, char *const argv[]) {
+  // segments are mapped as vmas added to *vmas, munmap them if it failed
+  size_t eip = load_elf(pgdir, vmas, name);
   if (eip == -1) return -1;
   ctx->cs = USEL(SEG_UCODE);
   ctx->ds = USEL(SEG_UDATA);
@@ -7,18 +7,24 @@
 #include "proc.h"
 #include "timer.h"
 #include "dev.h"
+#include "disk.h"
 
 void init_user_and_go();
 
 int main() {
   init_gdt();
   init_serial();
+  init_disk();
   init_fs();
   //init_page(); // uncomment me at WEEK3-virtual-memory
+  //init_bcache(); // uncomment me at WEEK3-virtual-memory, grow block cache by kalloc
+  //init_icache(); // uncomment me at WEEK3-virtual-memory, grow inode table by kalloc
+  //init_pcache(); // uncomment me at WEEK3-virtual-memory, page cache of file data by kalloc
   //init_cte(); // uncomment me at WEEK2-interrupt
   //init_timer(); // uncomment me at WEEK2-interrupt
   // init_proc(); // uncomment me at WEEK1-os-start
   //init_dev(); // uncomment me at Lab3-1
+  //init_disk_irq(); // uncomment me at WEEK5-semaphore, sleep on disk instead of spinning
   printf("Hello from OS!\n");
   init_user_and_go();
   panic("should never come back");
@@ -26,7 +32,7 @@ int main() {
 
 void init_user_and_go() {
   // WEEK1: ((void(*)())eip)();
-  uint32_t eip = load_elf(NULL, "loaduser");
+  uint32_t eip = load_elf(NULL, NULL, "loaduser");
   proc_t* proc = proc_alloc();
   proc->entry = eip;
   assert(eip != -1);
@@ -0,0 +1,32 @@
+#include "klib.h"
+#include "pci.h"
+
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+uint32_t pci_read(uint32_t dev, int reg) {
+  outl(PCI_CONFIG_ADDR, 0x80000000 | dev | (reg & 0xfc));
+  return inl(PCI_CONFIG_DATA);
+}
+
+void pci_write(uint32_t dev, int reg, uint32_t val) {
+  outl(PCI_CONFIG_ADDR, 0x80000000 | dev | (reg & 0xfc));
+  outl(PCI_CONFIG_DATA, val);
+}
+
+int pci_find_class(int class, int subclass, uint32_t *dev) {
+  // brute force scan of bus 0 is enough for QEMU's i440fx board
+  // return 0 and store the device to dev if found, otherwise -1
+  for (int slot = 0; slot < 32; ++slot) {
+    for (int func = 0; func < 8; ++func) {
+      uint32_t d = PCI_DEV(0, slot, func);
+      if ((pci_read(d, PCI_ID) & 0xffff) == 0xffff) continue;
+      uint32_t cls = pci_read(d, PCI_CLASS);
+      if ((cls >> 24) == class && ((cls >> 16) & 0xff) == subclass) {
+        *dev = d;
+        return 0;
+      }
+    }
+  }
+  return -1;
+}
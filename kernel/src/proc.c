@@ -27,6 +27,7 @@ proc_t *proc_alloc() {
 
 void proc_free(proc_t *proc) {
   // WEEK3-virtual-memory: free proc's pgdir and kstack and mark it UNUSED
+  // munmap all its vmas (vm_munmap) before vm_teardown, their pages are not its own
 
   TODO();
 }
@@ -54,7 +55,15 @@ void proc_yield() {
 }
 
 void proc_copycurr(proc_t *proc) {
-  // WEEK4-process-api: copy curr proc
+  // WEEK4-process-api: copy curr proc's memory and ctx, then proc_inheritcurr
+  // mmap: vm_mmap each of curr's vmas in proc too, shared ones fault in the same pages,
+  // others are copy on write by vm_copycurr
+  // TODO();
+}
+
+void proc_inheritcurr(proc_t *proc) {
+  // what a child gets from curr besides memory, for both fork and spawn
+  // WEEK4-process-api: set proc's parent to curr
   // WEEK5-semaphore: dup opened usems
   // Lab3-1: dup opened files
   // Lab3-2: dup cwd
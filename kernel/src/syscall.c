@@ -7,6 +7,7 @@
 #include "proc.h"
 #include "timer.h"
 #include "file.h"
+#include "disk.h"
 
 typedef int (*syshandle_t)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
 
@@ -27,6 +28,7 @@ void do_syscall(Context *ctx) {
     res = ((syshandle_t)(syscall_handle[sysnum]))(arg1, arg2, arg3, arg4, arg5);
   }
   ctx->eax = res;
+  isync_due(); // commit a log batch the timer found old, it cannot in irq
 }
 
 int sys_write(int fd, const void *buf, size_t count) {
@@ -47,10 +49,17 @@ int sys_brk(void *addr) {
   if (brk == 0) {
     // proc_curr()->brk = new_brk; // uncomment me in WEEK3-virtual-memory
   } else if (new_brk > brk) {
-    TODO();
+    // only reserve the pages as heap, vm_pgfault maps them on first touch
+    if (PAGE_UP(new_brk) > PAGE_UP(brk) &&
+        vm_mmap(&proc_curr()->vmas, PAGE_UP(brk), PAGE_UP(new_brk) - PAGE_UP(brk),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_FIXED, NULL, 0) == -1) return -1;
+    // proc_curr()->brk = new_brk; // uncomment me in WEEK3-virtual-memory
   } else if (new_brk < brk) {
-    // can just do nothing
-    // recover memory, Lab 1 extend
+    // unmap the heap pages above new_brk and free them
+    if (PAGE_UP(new_brk) < PAGE_UP(brk)) {
+      vm_munmap(vm_curr(), &proc_curr()->vmas, PAGE_UP(new_brk), PAGE_UP(brk) - PAGE_UP(new_brk));
+    }
+    // proc_curr()->brk = new_brk; // uncomment me in WEEK3-virtual-memory
   }
   return 0;
 }
@@ -68,6 +77,8 @@ void sys_sleep(int ticks) {
 
 int sys_exec(const char *path, char *const argv[]) {
   // TODO(); // WEEK2-interrupt, WEEK3-virtual-memory
+  // load_user to a new pgdir and an empty vma list, on success vm_munmap all of
+  // curr's vmas and take the new list, the segments fault in from it
   // DEFAULT
   printf("sys_exec is not implemented yet.");
   while(1);
@@ -146,14 +157,56 @@ int sys_unlink(const char *path) {
   return iremove(path);
 }
 
+void sys_sync() {
+  // modified pages of curr's shared mmaps first, they are only in page cache
+  vm_msync(vm_curr(), proc_curr()->vmas, NULL);
+  isync();
+  bsync();
+}
+
+int sys_fsync(int fd) {
+  // block cache doesn't know which file a block belongs to, sync all of it
+  file_t *file = proc_getfile(proc_curr(), fd);
+  if (file == NULL) return -1;
+  if (file->type == TYPE_FILE) vm_msync(vm_curr(), proc_curr()->vmas, file->inode);
+  isync();
+  bsync();
+  return 0;
+}
+
+int sys_spawn(const char *path, char *const argv[]) {
+  // fork then exec in one, the child is loaded from path directly, nothing of
+  // curr's memory is copied only to be thrown away by exec
+  proc_t *proc = proc_alloc();
+  if (proc == NULL) return -1;
+  if (load_user(proc->pgdir, &proc->vmas, proc->ctx, path, argv) != 0) {
+    proc_free(proc); // vmas mapped before the failure go with it
+    return -1;
+  }
+  proc_inheritcurr(proc);
+  proc_addready(proc);
+  return proc->pid;
+}
+
 // optional syscall
 
-void *sys_mmap() {
-  TODO();
+void *sys_mmap(void *addr, size_t len, int prot_flags, int fd, uint32_t off) {
+  // prot and flags share an argument, see mmap in user/ulib/syscall.c
+  int prot = prot_flags & (PROT_READ | PROT_WRITE);
+  int flags = prot_flags & ~prot;
+  if (flags & MAP_ANON) {
+    return (void*)vm_mmap(&proc_curr()->vmas, (size_t)addr, len, prot, flags, NULL, 0);
+  }
+  file_t *file = proc_getfile(proc_curr(), fd);
+  if (file == NULL || file->type != TYPE_FILE || !file->readable) return MAP_FAILED;
+  if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !file->writable) return MAP_FAILED;
+  // a shared page must be the file's page in page cache, private ones can be copies
+  if ((flags & MAP_SHARED) && ipageable(file->inode) != 0) return MAP_FAILED;
+  return (void*)vm_mmap(&proc_curr()->vmas, (size_t)addr, len, prot, flags, file->inode, off);
 }
 
-void sys_munmap(void *addr) {
-  TODO();
+int sys_munmap(void *addr, size_t len) {
+  return vm_munmap(vm_curr(), &proc_curr()->vmas, (size_t)addr, len);
 }
 
 int sys_clone(int (*entry)(void*), void *stack, void *arg, void (*ret_entry)(void)){
@@ -247,6 +300,9 @@ void *syscall_handle[NR_SYS] = {
   [SYS_mkfifo] = sys_mkfifo,
   [SYS_link] = sys_link,
   [SYS_symlink] = sys_symlink,
+  [SYS_sync] = sys_sync,
+  [SYS_fsync] = sys_fsync,
+  [SYS_spawn] = sys_spawn,
   // [SYS_spinlock_open] = sys_spinlock_open,
   // [SYS_spinlock_acquire] = sys_spinlock_acquire,
   // [SYS_spinlock_release] = sys_spinlock_release,
@@ -1,6 +1,8 @@
 #include "klib.h"
 #include "timer.h"
 #include "proc.h"
+#include "disk.h"
+#include "fs.h"
 
 #define TIMER_PORT 0x40
 #define FREQ_8253 1193182
@@ -17,6 +19,8 @@ void init_timer() {
 
 void timer_handle() {
   ++tick;
+  bflush_tick(tick);
+  isync_tick();
   // proc_yield(); // TODO: uncomment me in WEEK4-process-api
 }
 
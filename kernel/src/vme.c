@@ -22,6 +22,101 @@ void set_tss(uint32_t ss0, uint32_t esp0) {
 
 static PT kpt[PHY_MEM / PT_SIZE] __attribute__((used));
 
+// number of other owners of each page of kernel heap, pages are shared by
+// vm_copycurr for copy on write, 0 is the usual single owner
+static uint8_t pgshare[(PHY_MEM - KER_MEM) / PGSIZE];
+#define PGSHARE(page) pgshare[((size_t)(page) - KER_MEM) / PGSIZE]
+
+// mapped read-only for reads of anonymous memory, copied on first write
+static uint8_t zero_page[PGSIZE] PG_ALIGN;
+
+// buddy allocator of kernel heap [KER_MEM, PHY_MEM). A block of order o is
+// 2^o contiguous pages aligned to its size, its buddy is the other half of
+// the block of order o+1 holding it, free buddies are merged back at once.
+
+#define NR_KPAGE   ((PHY_MEM - KER_MEM) / PGSIZE)
+#define KPAGE(ptr) (((size_t)(ptr) - KER_MEM) / PGSIZE)
+
+typedef struct kblock {
+  struct kblock *prev, *next; // in the free list of its order
+} kblock_t;
+
+static kblock_t kfree_list[KORDER_MAX + 1]; // circular, with sentinel
+static uint32_t kfree_nblock[KORDER_MAX + 1];
+static uint8_t kblock_order[NR_KPAGE]; // order+1 at the first page of a free block, 0 otherwise
+
+static void kblock_add(kblock_t *b, int order) {
+  kblock_t *head = &kfree_list[order];
+  b->prev = head;
+  b->next = head->next;
+  head->next->prev = b;
+  head->next = b;
+  kblock_order[KPAGE(b)] = order + 1;
+  ++kfree_nblock[order];
+}
+
+static void kblock_del(kblock_t *b, int order) {
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  kblock_order[KPAGE(b)] = 0;
+  --kfree_nblock[order];
+}
+
+static void init_kheap() {
+  for (int i = 0; i <= KORDER_MAX; ++i) {
+    kfree_list[i].prev = kfree_list[i].next = &kfree_list[i];
+  }
+  // cut the heap into the biggest aligned blocks
+  for (size_t addr = KER_MEM; addr < PHY_MEM; ) {
+    int order = KORDER_MAX;
+    while ((addr & ((PGSIZE << order) - 1)) || addr + (PGSIZE << order) > PHY_MEM) --order;
+    kblock_add((kblock_t*)addr, order);
+    addr += PGSIZE << order;
+  }
+}
+
+void *kalloc_order(int order) {
+  // alloc 2^order contiguous pages, aligned to their size, NULL if no such block
+  assert(order >= 0 && order <= KORDER_MAX);
+  int o = order;
+  while (o <= KORDER_MAX && kfree_list[o].next == &kfree_list[o]) ++o;
+  if (o > KORDER_MAX) return NULL;
+  kblock_t *b = kfree_list[o].next;
+  kblock_del(b, o);
+  // split the bigger block, the upper halves stay free
+  while (o > order) {
+    --o;
+    kblock_add((kblock_t*)((size_t)b + (PGSIZE << o)), o);
+  }
+  return b;
+}
+
+void kfree_order(void *ptr, int order) {
+  // free 2^order pages got by kalloc_order(order)
+  size_t addr = (size_t)ptr;
+  assert(order >= 0 && order <= KORDER_MAX);
+  assert(addr >= KER_MEM && addr < PHY_MEM && (addr & ((PGSIZE << order) - 1)) == 0);
+  panic_on(kblock_order[KPAGE(addr)], "double free of kernel page");
+  while (order < KORDER_MAX) {
+    size_t buddy = addr ^ (PGSIZE << order);
+    if (buddy < KER_MEM || buddy >= PHY_MEM || kblock_order[KPAGE(buddy)] != order + 1) break;
+    kblock_del((kblock_t*)buddy, order);
+    addr = MIN(addr, buddy);
+    ++order;
+  }
+  kblock_add((kblock_t*)addr, order);
+}
+
+uint32_t kheap_stat(uint32_t nblock[KORDER_MAX + 1]) {
+  // return the number of free pages, and free blocks of each order if nblock
+  uint32_t npage = 0;
+  for (int i = 0; i <= KORDER_MAX; ++i) {
+    npage += kfree_nblock[i] << i;
+    if (nblock) nblock[i] = kfree_nblock[i];
+  }
+  return npage;
+}
+
 // WEEK3-virtual-memory
 
 void init_page() {
@@ -32,23 +127,31 @@ void init_page() {
   static_assert(sizeof(PT) == PGSIZE, "PT must be one page");
   static_assert(sizeof(PD) == PGSIZE, "PD must be one page");
 
+  // kernel writes to user's copy on write pages should fault as well
+  set_cr0(get_cr0() | CR0_WP);
 
   // WEEK3-virtual-memory: init kpd and kpt, identity mapping of [0 (or 4096), PHY_MEM)
   TODO();
 
-  // WEEK3-virtual-memory: init free memory at [KER_MEM, PHY_MEM), a heap for kernel
-  TODO();
+  // free memory at [KER_MEM, PHY_MEM), a heap for kernel
+  init_kheap();
 }
 
 void *kalloc() {
-  // WEEK3-virtual-memory: alloc a page from kernel heap, abort when heap empty
-  TODO();
+  // alloc a page from kernel heap, abort when heap empty
+  void *page = kalloc_order(0);
+  panic_on(page == NULL, "kernel heap empty");
+  return page;
 }
 
 void kfree(void *ptr) {
-  // WEEK3-virtual-memory: free a page to kernel heap
-  // you can just do nothing :)
-  // TODO();
+  // a shared page is freed by its last owner, zero_page never
+  if ((size_t)ptr < KER_MEM) return;
+  if (PGSHARE(ptr) > 0) {
+    --PGSHARE(ptr);
+    return;
+  }
+  kfree_order(ptr, 0);
 }
 
 PD *vm_alloc() {
@@ -104,10 +207,260 @@ void vm_unmap(PD *pgdir, size_t va, size_t len) {
 
 void vm_copycurr(PD *pgdir) {
   // WEEK4-process-api: copy memory mapped in curr pd to pgdir
-  TODO();
+  // pages are shared, writable ones become read-only PTE_COW in both and are
+  // copied by vm_pgfault on the first write
+  // pages of page cache are skipped, they fault in again by the vmas
+  PD *curr = vm_curr();
+  for (size_t va = PHY_MEM; va < USR_MEM; va += PT_SIZE) {
+    PDE *pde = &curr->pde[ADDR2DIR(va)];
+    if (!pde->present) continue;
+    PT *pt = PDE2PT(*pde);
+    for (int i = 0; i < NR_PTE; ++i) {
+      PTE *pte = &pt->pte[i];
+      if (!pte->present || (pte->val & PTE_PCACHE)) continue;
+      if (pte->val & PTE_W) pte->val = (pte->val & ~PTE_W) | PTE_COW;
+      if (PTE2PG(*pte) != zero_page) ++PGSHARE(PTE2PG(*pte));
+      *vm_walkpte(pgdir, va + i * PGSIZE, PTE_P | PTE_W | PTE_U) = *pte;
+    }
+  }
+  flush_tlb();
 }
 
-void vm_pgfault(size_t va, int errcode) {
+// mmap. Pages of a vma are faulted in from page cache on first touch.
+// MAP_SHARED maps the cached page itself, so all mappings and read see the
+// same data, modified ones are written to the file at munmap, sync or fsync.
+// MAP_PRIVATE maps the cached page read-only and copies it on first write.
+// Segments of user programs are MAP_PRIVATE areas too, see load_elf.
+// MAP_ANON maps zero_page on first read and a zeroed page of the process's
+// own on first write.
+// After fork, own pages are copy on write (PTE_COW), see vm_copycurr.
+
+#define VMA_NUM   256
+#define FAULT_RA  8 // pages read ahead from a file page fault
+#define MMAP_BASE 0x40000000             // above user image and heap
+#define MMAP_TOP  (USR_MEM - 0x01000000) // below user stack
+
+static vma_t vma_pool[VMA_NUM];
+
+static vma_t *vma_alloc() {
+  for (int i = 0; i < VMA_NUM; ++i) {
+    if (vma_pool[i].end == 0) return &vma_pool[i];
+  }
+  return NULL;
+}
+
+static void vma_free(vma_t *v) {
+  if (v->inode) iclose(v->inode);
+  memset(v, 0, sizeof *v);
+}
+
+static vma_t *vma_find(vma_t *list, size_t va) {
+  for (; list && list->start <= va; list = list->next) {
+    if (va < list->end) return list;
+  }
+  return NULL;
+}
+
+static vma_t *vma_overlap(vma_t *list, size_t start, size_t end) {
+  // the first vma overlapping [start, end), NULL if none
+  for (; list && list->start < end; list = list->next) {
+    if (list->end > start) return list;
+  }
+  return NULL;
+}
+
+size_t vm_mmap(vma_t **list, size_t addr, size_t len, int prot, int flags, inode_t *inode, uint32_t off) {
+  // map [addr, addr+len) to inode's data from off (or anonymous memory if
+  // MAP_ANON), pages are mapped on fault
+  // addr is a hint, if it is not usable, take the highest free range
+  // with MAP_FIXED, addr must be usable, anywhere in user memory
+  // return the address, or -1 if failed
+  int share = flags & (MAP_SHARED | MAP_PRIVATE);
+  if (len == 0 || len > MMAP_TOP - MMAP_BASE || ADDR2OFF(off)) return -1;
+  if (share != MAP_SHARED && share != MAP_PRIVATE) return -1;
+  // anonymous pages are the process's own, they cannot be shared
+  if ((flags & MAP_ANON) ? (share == MAP_SHARED || inode) : !inode) return -1;
+  len = PAGE_UP(len);
+  if (flags & MAP_FIXED) {
+    if (ADDR2OFF(addr) || addr < PHY_MEM || addr > USR_MEM - len ||
+        vma_overlap(*list, addr, addr + len)) return -1;
+  } else if (ADDR2OFF(addr) || addr < MMAP_BASE || addr > MMAP_TOP - len ||
+      vma_overlap(*list, addr, addr + len)) {
+    addr = MMAP_TOP - len;
+    for (vma_t *v; (v = vma_overlap(*list, addr, addr + len)) != NULL; ) {
+      if (v->start < MMAP_BASE + len) return -1;
+      addr = v->start - len;
+    }
+  }
+  flags &= ~MAP_FIXED; // how to place it, not kept in the vma
+  vma_t *prev = NULL;
+  while (*list && (*list)->start < addr) {
+    prev = *list;
+    list = &prev->next;
+  }
+  if (prev && prev->end == addr && !prev->inode && !inode &&
+      prev->prot == prot && prev->flags == flags) {
+    // grow the anonymous area right below, as brk does to the heap
+    prev->end = addr + len;
+    return addr;
+  }
+  vma_t *v = vma_alloc();
+  if (v == NULL) return -1;
+  v->start = addr;
+  v->end = addr + len;
+  v->prot = prot;
+  v->flags = flags;
+  v->inode = inode ? idup(inode) : NULL;
+  v->off = off;
+  v->next = *list;
+  *list = v;
+  return addr;
+}
+
+static void vma_unmap(PD *pgdir, vma_t *v, size_t start, size_t end) {
+  // unmap the pages of v in [start, end), write modified shared ones to the file
+  for (size_t va = start; va < end; va += PGSIZE) {
+    PTE *pte = vm_walkpte(pgdir, va, 0);
+    if (pte == NULL || !pte->present) continue;
+    if (pte->val & PTE_PCACHE) {
+      fpage_t *page = plookup(PTE2PG(*pte));
+      if (pte->dirty) pflush(v->inode, page);
+      pput(page);
+    } else {
+      kfree(PTE2PG(*pte));
+    }
+    pte->val = 0;
+  }
+}
+
+int vm_munmap(PD *pgdir, vma_t **list, size_t addr, size_t len) {
+  // unmap [addr, addr+len), vmas in it are trimmed, split or removed
+  if (ADDR2OFF(addr) || len == 0) return -1;
+  size_t end = PAGE_UP(addr + len);
+  for (vma_t **pp = list, *v; (v = *pp) != NULL && v->start < end; ) {
+    if (v->end <= addr) {
+      pp = &v->next;
+      continue;
+    }
+    size_t s = MAX(v->start, addr), e = MIN(v->end, end);
+    vma_t *tail = NULL;
+    if (s > v->start && e < v->end && (tail = vma_alloc()) == NULL) return -1;
+    vma_unmap(pgdir, v, s, e);
+    if (tail) {
+      // a hole in the middle, split off the part after it
+      *tail = *v;
+      tail->start = e;
+      tail->off += e - v->start;
+      tail->inode = v->inode ? idup(v->inode) : NULL;
+      v->end = s;
+      v->next = tail;
+      pp = &tail->next;
+    } else if (s > v->start) {
+      v->end = s;
+      pp = &v->next;
+    } else if (e < v->end) {
+      v->off += e - v->start;
+      v->start = e;
+      pp = &v->next;
+    } else {
+      *pp = v->next;
+      vma_free(v);
+    }
+  }
+  if (pgdir == vm_curr()) flush_tlb();
+  return 0;
+}
+
+static void vm_segv(size_t va, int errcode) {
+  // a bad access of curr, kill it rather than the whole kernel
   printf("pagefault @ 0x%p, errcode = %d\n", va, errcode);
-  panic("pgfault");
+  proc_makezombie(proc_curr(), -1);
+  INT(0x81);
+  panic("zombie is running");
+}
+
+void vm_msync(PD *pgdir, vma_t *list, inode_t *inode) {
+  // write modified pages of shared vmas (of inode, or all if NULL) to files
+  for (vma_t *v = list; v; v = v->next) {
+    if (!(v->flags & MAP_SHARED) || (inode && v->inode != inode)) continue;
+    for (size_t va = v->start; va < v->end; va += PGSIZE) {
+      PTE *pte = vm_walkpte(pgdir, va, 0);
+      if (pte == NULL || !pte->present || !pte->dirty) continue;
+      pflush(v->inode, plookup(PTE2PG(*pte)));
+      pte->dirty = 0;
+    }
+  }
+  if (pgdir == vm_curr()) flush_tlb();
+}
+
+void vm_pgfault(size_t va, int errcode) {
+  // map the page of va if it is in a vma, otherwise kill curr
+  // errcode bit 1 is set if it is a write
+  int write = errcode & 2;
+  PTE *pte = vm_walkpte(vm_curr(), PAGE_DOWN(va), 0);
+  if (write && pte && (pte->val & PTE_COW)) {
+    // copy on write, the last owner keeps the page itself
+    void *page = PTE2PG(*pte);
+    if (page == zero_page || PGSHARE(page) > 0) {
+      void *copy = kalloc();
+      memcpy(copy, page, PGSIZE);
+      kfree(page);
+      page = copy;
+    }
+    pte->val = MAKE_PTE(page, PTE_U | PTE_W);
+    flush_tlb();
+    return;
+  }
+  vma_t *v = vma_find(proc_curr()->vmas, va);
+  if (v == NULL || (write && !(v->prot & PROT_WRITE))) {
+    vm_segv(va, errcode);
+  }
+  pte = vm_walkpte(vm_curr(), PAGE_DOWN(va), PTE_P | PTE_W | PTE_U);
+  if ((v->flags & MAP_ANON) && !write) {
+    // read before any write, share zero_page until then
+    pte->val = MAKE_PTE(zero_page, (v->prot & PROT_WRITE) ? PTE_U | PTE_COW : PTE_U);
+    flush_tlb();
+    return;
+  }
+  if (v->flags & MAP_ANON) {
+    void *zero = kalloc();
+    memset(zero, 0, PGSIZE);
+    pte->val = MAKE_PTE(zero, (v->prot & PROT_WRITE) ? PTE_U | PTE_W : PTE_U);
+    return;
+  }
+  fpage_t *page;
+  if (pte->present) {
+    // write to a private page still shared with page cache
+    assert(pte->val & PTE_PCACHE);
+    page = plookup(PTE2PG(*pte));
+  } else {
+    uint32_t off = v->off + PAGE_DOWN(va) - v->start;
+    // prefetch a few pages from here in the vma, so a process touching its pages
+    // in order waits for one read, cached ones are skipped
+    ireadahead(v->inode, off / PGSIZE, MIN(FAULT_RA, (v->end - PAGE_DOWN(va)) / PGSIZE));
+    page = pget(v->inode, off / PGSIZE);
+    if (page == NULL && (v->flags & MAP_PRIVATE)) {
+      // no page cache (e.g. EASY_FS), read a copy of the process's own
+      void *copy = kalloc();
+      memset(copy, 0, PGSIZE);
+      iread(v->inode, off, copy, PGSIZE);
+      pte->val = MAKE_PTE(copy, (v->prot & PROT_WRITE) ? PTE_U | PTE_W : PTE_U);
+      flush_tlb();
+      return;
+    }
+    // shared page cannot be served now, e.g. all pages are pinned
+    if (page == NULL) vm_segv(va, errcode);
+  }
+  if (v->flags & MAP_SHARED) {
+    int prot = (v->prot & PROT_WRITE) ? PTE_U | PTE_W : PTE_U;
+    pte->val = MAKE_PTE(pdata(page), prot | PTE_PCACHE);
+  } else if (!write) {
+    pte->val = MAKE_PTE(pdata(page), PTE_U | PTE_PCACHE);
+  } else {
+    void *copy = kalloc();
+    memcpy(copy, pdata(page), PGSIZE);
+    pput(page);
+    pte->val = MAKE_PTE(copy, PTE_U | PTE_W);
+  }
+  flush_tlb();
 }
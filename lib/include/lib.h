@@ -89,6 +89,15 @@ char *strtok(char *__restrict s, const char *__restrict delim);
 #define O_TRUNC   0x400
 #define O_DIR     0x800
 
+// mmap prot and flags, they share one syscall argument
+#define PROT_READ   0x01
+#define PROT_WRITE  0x02
+#define MAP_SHARED  0x10
+#define MAP_PRIVATE 0x20
+#define MAP_ANON    0x40 // zero filled memory, no file, fd is ignored
+#define MAP_FIXED   0x80 // map at addr exactly, fail if it is used
+#define MAP_FAILED  ((void*)-1)
+
 // seek whence
 #define SEEK_SET 0
 #define SEEK_CUR 1
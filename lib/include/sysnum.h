@@ -43,7 +43,10 @@
 #define SYS_spinlock_acquire 39
 #define SYS_spinlock_release 40
 #define SYS_spinlock_close   41
+#define SYS_sync       42
+#define SYS_fsync      43
+#define SYS_spawn      44
 
-#define NR_SYS         42
+#define NR_SYS         45
 
 #endif
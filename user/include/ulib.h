@@ -26,13 +26,16 @@ uint32_t lseek(int fd, uint32_t off, int whence);
 int fstat(int fd, struct stat *st);
 int chdir(const char *path);
 int unlink(const char *path);
+void sync();
+int fsync(int fd);
+int spawn(const char *path, char *const argv[]);
 
 #define P sem_p
 #define V sem_v
 
 // optional syscall
-void *mmap();
-void munmap(void *addr);
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, uint32_t off);
+int munmap(void *addr, size_t len);
 int clone(int (*entry)(void*), void *stack, void *arg);
 int join(int tid, void **retval);
 int detach(int tid);
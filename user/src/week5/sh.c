@@ -19,18 +19,12 @@ int main() {
     }
     if (argc > 0) {
       argv[argc] = 0;
-      int pid = fork();
-      if (pid == -1) {
-        printf("sh: fork failed.\n");
+      // spawn loads the program into a new proc, no copy of sh to throw away
+      if (spawn(argv[0], argv) == -1) {
+        printf("sh: exec failed.\n");
         continue;
-      } else if (pid == 0) {
-        if (exec(argv[0], argv) == -1) {
-          printf("sh: exec failed.\n");
-          return 1;
-        }
-      } else {
-        wait(NULL);
       }
+      wait(NULL);
     }
   }
 }
@@ -31,12 +31,21 @@ typedef union header Header;
 static Header base;
 static Header *freep;
 
+// big blocks get their own anonymous mmap instead of growing the heap,
+// they are marked by s.ptr and go back to the kernel at free
+#define MMAP_MIN 65536 // bytes
+static Header mmapped;
+
 void
 free(void *ap)
 {
   Header *bp, *p;
 
   bp = (Header*)ap - 1;
+  if(bp->s.ptr == &mmapped){
+    munmap(bp, bp->s.size * sizeof(Header));
+    return;
+  }
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -77,6 +86,14 @@ malloc(size_t nbytes)
   uint32_t nunits;
 
   nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  if(nunits * sizeof(Header) >= MMAP_MIN){
+    p = mmap(0, nunits * sizeof(Header), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if(p == MAP_FAILED)
+      return 0;
+    p->s.ptr = &mmapped;
+    p->s.size = nunits;
+    return (void*)(p + 1);
+  }
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
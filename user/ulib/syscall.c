@@ -101,14 +101,27 @@ int unlink(const char *path) {
   return (int)syscall(SYS_unlink, (size_t)path, 0, 0, 0, 0);
 }
 
+void sync() {
+  syscall(SYS_sync, 0, 0, 0, 0, 0);
+}
+
+int fsync(int fd) {
+  return (int)syscall(SYS_fsync, (size_t)fd, 0, 0, 0, 0);
+}
+
+int spawn(const char *path, char *const argv[]) {
+  return (int)syscall(SYS_spawn, (size_t)path, (size_t)argv, 0, 0, 0);
+}
+
 // optional syscall
 
-void *mmap() {
-  return (void*)syscall(SYS_mmap, 0, 0, 0, 0, 0);
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, uint32_t off) {
+  // syscall has 5 arguments only, prot and flags do not overlap, pass them in one
+  return (void*)syscall(SYS_mmap, (size_t)addr, len, prot | flags, fd, off);
 }
 
-void munmap(void *addr) {
-  syscall(SYS_munmap, (size_t)addr, 0, 0, 0, 0);
+int munmap(void *addr, size_t len) {
+  return (int)syscall(SYS_munmap, (size_t)addr, len, 0, 0, 0);
 }
 
 // TODO: 实际当中的Linux是怎样处理这个功能的？
@@ -36,13 +36,20 @@ void panic(const char *msg) {
 #define SUPER_BLK   BLK_OFF        // block no of super block
 #define BITMAP_BLK  (BLK_OFF + 1)  // block no of bitmap
 #define INODE_START (BLK_OFF + 2)  // start block no of inode blocks
-#define DATA_START  (BLK_OFF + 32) // start block no of data blocks
+#define DATA_START  (BLK_OFF + 64) // start block no of data blocks
+#define LOG_START   DATA_START     // block no of log header, see kernel/src/fs.c
+#define LOG_BLKS    128            // header and 127 log blocks
 
 #define IPERBLK   (BLK_SIZE / sizeof(dinode_t)) // inode num per blk
 #define INODE_NUM ((DATA_START - INODE_START) * IPERBLK)
 
+// block groups, inode group g keeps its data in block group g, see kernel/src/fs.c
+#define BG_BLKS 1024
+#define BG_NUM  (BLK_NUM / BG_BLKS)
+
 #define NDIRECT   12
 #define NINDIRECT (BLK_SIZE / sizeof(uint32_t))
+#define NLEVEL    3 // single, double and triple indirect
 
 #define TYPE_NONE 0
 #define TYPE_FILE 1
@@ -58,20 +65,67 @@ typedef union {
   uint32_t u32buf[BLK_SIZE / 4];
 } blk_t;
 
+#define FEAT_EXTENT  0x1 // new inodes use extent tree
+#define FEAT_DIRHASH 0x2 // big dirs get a hash index
+#define FEAT_INLINE  0x4 // small files and dirs keep data in dinode
+
 // super block
 typedef struct {
-  uint32_t bitmap; // block num of bitmap
-  uint32_t istart; // start block no of inode blocks
-  uint32_t inum;   // total inode num
-  uint32_t root;   // inode no of root dir
+  uint32_t bitmap;   // block num of bitmap
+  uint32_t istart;   // start block no of inode blocks
+  uint32_t inum;     // total inode num
+  uint32_t root;     // inode no of root dir
+  uint32_t features; // FEAT_*
+  uint32_t logstart; // block no of log header, log blocks follow it
+  uint32_t nlog;     // block num of log (header included), 0 if no log
 } sb_t;
 
+// extent tree, see kernel/src/fs.c
+typedef struct {
+  uint16_t n;     // entries used
+  uint16_t depth; // 0 for leaf
+} ext_hdr_t;
+
+typedef struct {
+  uint32_t lblk;  // first file block it covers
+  uint32_t start; // first disk block (leaf) or child node block (index)
+  uint32_t len;   // block num, leaf only
+} extent_t;
+
+#define EXT_ROOT_NUM  4
+#define EXT_NODE_NUM  ((BLK_SIZE - sizeof(ext_hdr_t)) / sizeof(extent_t))
+#define EXT_MAX_DEPTH 4
+
+typedef struct {
+  ext_hdr_t hdr;
+  extent_t e[EXT_ROOT_NUM];
+} ext_root_t;
+
+typedef struct {
+  ext_hdr_t hdr;
+  extent_t e[EXT_NODE_NUM];
+} ext_node_t;
+
+#define DI_EXTENT 0x1 // data is mapped by ext instead of addrs
+#define DI_INDEX  0x2 // hash index of a dir
+#define DI_INLINE 0x4 // data is in dinode itself, no data block
+
+#define INLINE_MAX 228 // bytes of inline data, makes dinode 256 bytes
+
 // on-disk inode
 typedef struct {
   uint32_t type;   // file type
   uint32_t device; // if it is a dev, its dev_id
   uint32_t size;   // file size
-  uint32_t addrs[NDIRECT + 1]; // data block addresses, 12 direct and 1 indirect
+  uint32_t flags;  // DI_*
+  union {
+    uint32_t addrs[NDIRECT + NLEVEL]; // data block addresses, 12 direct, 1 indirect, 1 double and 1 triple indirect
+    ext_root_t ext;                   // if flags & DI_EXTENT
+    uint8_t data[INLINE_MAX];         // if flags & DI_INLINE
+  };
+  uint32_t hidx;  // dir only, inode no of its hash index, 0 if none
+  uint32_t hused; // dir only, used slots of hash index, deleted ones included
+  uint32_t hfree; // dir only, first free dirent index + 1 of a hashed dir, 0 if none
 } dinode_t;
 
 // directory is a file containing a sequence of dirent structures
@@ -82,10 +136,17 @@ typedef struct {
   char name[MAX_NAME + 1]; // name of the file
 } dirent_t;
 
+// hash index of big dir, see kernel/src/fs.c
+#define DH_MIN     (BLK_SIZE / sizeof(dirent_t)) // index dir bigger than this
+#define DH_MIN_CAP (BLK_SIZE / sizeof(uint32_t))
+
 struct {blk_t blocks[IMG_BLK];} *img; // pointor to the img mapped memory
 sb_t *sb; // pointor to the super block
 blk_t *bitmap; // pointor to the bitmap block
 dinode_t *root; // pointor to the root dir's inode
+int use_extent = 1; // build files with extent tree, -b to use addrs
+int use_dirhash = 1; // index big dirs, -l to keep them linear
+int use_inline = 1; // keep small files and dirs in dinode, -n to always use blocks
 
 // get the pointer to the memory of block no
 static inline blk_t *bget(uint32_t no) {
@@ -99,16 +160,29 @@ static inline dinode_t *iget(uint32_t no) {
 }
 
 void init_disk();
-uint32_t balloc();
-uint32_t ialloc(int type);
+uint32_t balloc(uint32_t goal);
+uint32_t ialloc(int type, uint32_t goal);
 blk_t *iwalk(dinode_t *file, uint32_t blk_no);
 void iappend(dinode_t *file, const void *buf, uint32_t size);
 void add_file(char *path);
+void dhash_build(dinode_t *dir);
 
 int main(int argc, char *argv[]) {
   // argv[1] is target user.img, argv[2..argc-1] are files you need to add
+  // if argv[1] is -b, use direct and indirect addrs instead of extent tree
+  // if argv[1] is -l, do not build hash index for dirs
+  // if argv[1] is -n, do not inline small files and dirs
+  while (argc > 1 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-b") == 0) use_extent = 0;
+    else if (strcmp(argv[1], "-l") == 0) use_dirhash = 0;
+    else if (strcmp(argv[1], "-n") == 0) use_inline = 0;
+    else panic("unknown option");
+    argc--;
+    argv++;
+  }
   assert(argc > 2);
   static_assert(BLK_SIZE % sizeof(dinode_t) == 0, "sizeof inode should divide BLK_SIZE");
+  static_assert(sizeof(ext_node_t) <= BLK_SIZE, "ext node should fit a block");
   char *target = argv[1];
   int tfd = open(target, O_RDWR | O_CREAT | O_TRUNC, 0777);
   if (tfd < 0) panic("open target error");
@@ -120,6 +194,7 @@ int main(int argc, char *argv[]) {
   for (int i = 2; i < argc; ++i) {
     add_file(argv[i]);
   }
+  if (use_dirhash) dhash_build(root);
   munmap(img, IMG_SIZE);
   close(tfd);
   return 0;
@@ -130,11 +205,21 @@ void init_disk() {
   sb->bitmap = BITMAP_BLK;
   sb->istart = INODE_START;
   sb->inum = INODE_NUM;
+  sb->features = (use_extent ? FEAT_EXTENT : 0) | (use_dirhash ? FEAT_DIRHASH : 0) |
+                 (use_inline ? FEAT_INLINE : 0);
+  sb->logstart = LOG_START;
+  sb->nlog = LOG_BLKS;
   bitmap = bget(BITMAP_BLK);
-  // mark first 64 blocks used
-  bitmap->u32buf[0] = bitmap->u32buf[1] = 0xffffffff;
+  // mark blocks before DATA_START used
+  for (int i = 0; i < DATA_START / 32; ++i) {
+    bitmap->u32buf[i] = 0xffffffff;
+  }
+  // and the log, it is empty since img is zeroed
+  for (int i = LOG_START / 32; i < (LOG_START + LOG_BLKS) / 32; ++i) {
+    bitmap->u32buf[i] = 0xffffffff;
+  }
   // alloc and init root inode
-  sb->root = ialloc(TYPE_DIR);
+  sb->root = ialloc(TYPE_DIR, 1);
   root = iget(sb->root);
   // set root's . and ..
   dirent_t dirent;
@@ -145,41 +230,165 @@ void init_disk() {
   iappend(root, &dirent, sizeof dirent);
 }
 
-uint32_t balloc() {
-  // alloc a unused block, mark it on bitmap, then return its no
-  static uint32_t next_blk = 64;
-  if (next_blk >= BLK_NUM) panic("no more block");
-  bitmap->u8buf[next_blk / 8] |= (1 << (next_blk % 8));
-  return next_blk++;
+uint32_t balloc(uint32_t goal) {
+  // alloc the first unused block from goal, mark it on bitmap, then return its no
+  for (uint32_t i = 0; i < BLK_NUM; ++i) {
+    uint32_t no = (goal + i) % BLK_NUM;
+    if (bitmap->u8buf[no / 8] & (1 << (no % 8))) continue;
+    bitmap->u8buf[no / 8] |= (1 << (no % 8));
+    return no;
+  }
+  panic("no more block");
 }
 
-uint32_t ialloc(int type) {
-  // alloc a unused inode, return its no
+uint32_t ialloc(int type, uint32_t goal) {
+  // alloc the first unused inode from goal, return its no
   // first inode always unused, because dirent's inode 0 mark invalid
-  static uint32_t next_inode = 1;
-  if (next_inode >= INODE_NUM) panic("no more inode");
-  iget(next_inode)->type = type;
-  return next_inode++;
+  for (uint32_t i = 0; i < INODE_NUM; ++i) {
+    uint32_t no = (goal + i) % INODE_NUM;
+    if (no == 0 || iget(no)->type != TYPE_NONE) continue;
+    iget(no)->type = type;
+    iget(no)->flags = (use_extent ? DI_EXTENT : 0) | (use_inline ? DI_INLINE : 0);
+    return no;
+  }
+  panic("no more inode");
+}
+
+static uint32_t ino(dinode_t *file) {
+  return ((uint8_t*)file - bget(INODE_START)->u8buf) / sizeof(dinode_t);
+}
+
+static uint32_t bgoal(dinode_t *file, uint32_t blk_no) {
+  // where to alloc the file's blk_no th block: right after its blk_no-1 th block,
+  // or the start of the inode's group for the first one
+  if (blk_no == 0) return ino(file) * BG_NUM / INODE_NUM * BG_BLKS;
+  return iwalk(file, blk_no - 1) - img->blocks + BLK_OFF + 1;
+}
+
+static int ext_search(ext_hdr_t *hdr, extent_t *e, uint32_t lblk) {
+  // index of the last entry whose lblk <= lblk, -1 if none
+  int i = -1;
+  for (int j = 0; j < hdr->n && e[j].lblk <= lblk; ++j) i = j;
+  return i;
+}
+
+static uint32_t ext_walk(dinode_t *file, uint32_t lblk) {
+  // return the disk block of file block lblk, if no, alloc it
+  // file only grows by append, so lblk is next to the last mapped one
+  ext_hdr_t *path_hdr[EXT_MAX_DEPTH + 1];
+  extent_t *path_e[EXT_MAX_DEPTH + 1];
+  int lv = 0;
+  path_hdr[0] = &file->ext.hdr;
+  path_e[0] = file->ext.e;
+  while (path_hdr[lv]->depth > 0) {
+    int i = ext_search(path_hdr[lv], path_e[lv], lblk);
+    assert(i >= 0);
+    ext_node_t *node = (ext_node_t*)bget(path_e[lv][i].start);
+    lv++;
+    path_hdr[lv] = &node->hdr;
+    path_e[lv] = node->e;
+  }
+  int i = ext_search(path_hdr[lv], path_e[lv], lblk);
+  extent_t *last = i >= 0 ? &path_e[lv][i] : NULL;
+  if (last && lblk < last->lblk + last->len) {
+    return last->start + (lblk - last->lblk);
+  }
+  uint32_t pblk = balloc(bgoal(file, lblk));
+  if (last && last->lblk + last->len == lblk && last->start + last->len == pblk) {
+    // continuous, just extend the last extent
+    last->len++;
+    return pblk;
+  }
+  extent_t entry = {lblk, pblk, 1};
+  for (; lv >= 0; --lv) {
+    ext_hdr_t *hdr = path_hdr[lv];
+    int cap = lv == 0 ? EXT_ROOT_NUM : EXT_NODE_NUM;
+    if (hdr->n < cap) {
+      path_e[lv][hdr->n++] = entry;
+      return pblk;
+    }
+    if (lv == 0) break;
+    // node is full, start a new node at this level holding only entry
+    uint32_t blk = balloc(pblk + 1);
+    ext_node_t *node = (ext_node_t*)bget(blk);
+    node->hdr.depth = hdr->depth;
+    node->hdr.n = 1;
+    node->e[0] = entry;
+    entry = (extent_t){lblk, blk, 0};
+  }
+  // root is full: move it to a new node with entry, root points to it
+  uint32_t blk = balloc(pblk + 1);
+  ext_node_t *node = (ext_node_t*)bget(blk);
+  node->hdr = file->ext.hdr;
+  memcpy(node->e, file->ext.e, sizeof file->ext.e);
+  node->e[node->hdr.n++] = entry;
+  if (file->ext.hdr.depth >= EXT_MAX_DEPTH) panic("extent tree too deep");
+  file->ext.hdr.depth++;
+  file->ext.hdr.n = 1;
+  file->ext.e[0] = (extent_t){0, blk, 0};
+  return pblk;
 }
 
 blk_t *iwalk(dinode_t *file, uint32_t blk_no) {
   // return the pointer to the file's data's blk_no th block, if no, alloc it
+  if (file->flags & DI_EXTENT) {
+    return bget(ext_walk(file, blk_no));
+  }
   if (blk_no < NDIRECT) {
     // direct address
-    TODO();
+    if (file->addrs[blk_no] == 0) file->addrs[blk_no] = balloc(bgoal(file, blk_no));
+    return bget(file->addrs[blk_no]);
   }
+  // indirect address, find which level's tree blk_no falls in
+  uint32_t goal = bgoal(file, blk_no);
   blk_no -= NDIRECT;
-  if (blk_no < NINDIRECT) {
-    // indirect address
-    TODO();
+  int level = 1;
+  uint32_t span = NINDIRECT;
+  while (blk_no >= span) {
+    if (level == NLEVEL) panic("file too big");
+    blk_no -= span;
+    span *= NINDIRECT;
+    level++;
+  }
+  uint32_t *slot = &file->addrs[NDIRECT + level - 1];
+  for (; level > 0; level--) {
+    if (*slot == 0) *slot = balloc(goal);
+    span /= NINDIRECT;
+    slot = &bget(*slot)->u32buf[blk_no / span];
+    blk_no %= span;
   }
-  panic("file too big");
+  if (*slot == 0) *slot = balloc(goal);
+  return bget(*slot);
 }
 
 void iappend(dinode_t *file, const void *buf, uint32_t size) {
   // append buf to file's data, remember to add file->size
   // you can append block by block
-  TODO();
+  const uint8_t *src = buf;
+  if (file->flags & DI_INLINE) {
+    if (file->size + size <= INLINE_MAX) {
+      memcpy(&file->data[file->size], buf, size);
+      file->size += size;
+      return;
+    }
+    // spill the inline data to blocks
+    uint8_t data[INLINE_MAX];
+    uint32_t n = file->size;
+    memcpy(data, file->data, n);
+    memset(file->data, 0, INLINE_MAX);
+    file->flags &= ~DI_INLINE;
+    file->size = 0;
+    iappend(file, data, n);
+  }
+  while (size > 0) {
+    uint32_t off = file->size % BLK_SIZE;
+    uint32_t n = MIN(size, BLK_SIZE - off);
+    blk_t *blk = iwalk(file, file->size / BLK_SIZE);
+    memcpy(&blk->u8buf[off], src, n);
+    src += n;
+    size -= n;
+    file->size += n;
+  }
 }
 
 void add_file(char *path) {
@@ -187,7 +396,7 @@ void add_file(char *path) {
   FILE *fp = fopen(path, "rb");
   if (!fp) panic("file not exist");
   // alloc a inode
-  uint32_t inode_blk = ialloc(TYPE_FILE);
+  uint32_t inode_blk = ialloc(TYPE_FILE, sb->root);
   dinode_t *inode = iget(inode_blk);
   // append dirent to root dir
   dirent_t dirent;
@@ -195,6 +404,43 @@ void add_file(char *path) {
   strcpy(dirent.name, basename(path));
   iappend(root, &dirent, sizeof dirent);
   // write the file's data, first read it to buf then call iappend
-  TODO();
+  size_t n;
+  while ((n = fread(buf, 1, BLK_SIZE, fp)) > 0) {
+    iappend(inode, buf, n);
+  }
   fclose(fp);
 }
+
+static uint32_t dhash(const char *name) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *name; ++name) {
+    h = (h ^ (uint8_t)*name) * 16777619u;
+  }
+  return h;
+}
+
+void dhash_build(dinode_t *dir) {
+  // build the hash index of dir if it is big
+  static uint32_t zero[DH_MIN_CAP];
+  uint32_t n = dir->size / sizeof(dirent_t), cap = DH_MIN_CAP;
+  if (n <= DH_MIN) return;
+  while (cap < n * 2) cap *= 2;
+  dir->hidx = ialloc(TYPE_FILE, ino(dir));
+  dinode_t *idx = iget(dir->hidx);
+  idx->flags = (idx->flags & ~DI_INLINE) | DI_INDEX;
+  for (uint32_t i = 0; i < cap; i += DH_MIN_CAP) {
+    iappend(idx, zero, sizeof zero);
+  }
+  for (uint32_t i = 0; i < n; ++i) {
+    uint32_t off = i * sizeof(dirent_t);
+    dirent_t *dirent = (dirent_t*)&iwalk(dir, off / BLK_SIZE)->u8buf[off % BLK_SIZE];
+    // probe linearly to the first empty slot
+    uint32_t h = dhash(dirent->name) & (cap - 1), *slot;
+    while (*(slot = &iwalk(idx, h / DH_MIN_CAP)->u32buf[h % DH_MIN_CAP]) != 0) {
+      h = (h + 1) & (cap - 1);
+    }
+    *slot = i + 1;
+    dir->hused++;
+  }
+}